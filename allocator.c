@@ -1,166 +1,2151 @@
 #include "allocator.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define MAX_HEAP_SIZE (128 * 1024 * 1024)  
 
+// block sizes are multiples of this, as is the header, so every block comes out aligned to it
+#define ALIGNMENT 16
+// splitting a block leaves at least this many bytes in the remainder
+#define MIN_SPLIT 32
+
+// mymalloc_near looks for space within the same page as its hint
+#define PAGE_SIZE 4096
+#define NEAR_STEPS 64
+
+// with cache coloring, successive large blocks start this many cache lines apart, cycling
+#define CACHE_LINE 64
+#define COLORS 16
+
+// with "thp" the heap is backed by transparent huge pages of this size, and given back in them
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+// realloc moves at least this big are timed for allocator_stats
+#define LARGE_MOVE (64 * 1024)
+
+// with "queue:N", myfree only queues blocks, at most N of them, for the next allocation to free
+#define FREE_QUEUE_MAX 4096
+
+// epoch-based reclamation and bump pages serve this many threads between allocator_resets
+#define MAX_THREADS 256
+// a thread tries to advance the epoch after this many myfree_deferred calls,
+// or this many ebr_exits while blocks retired in the current epoch wait
+#define EBR_ADVANCE 64
+
+// Requests up to CLASS_MAX bytes may be rounded up to a size class; classes are
+// multiples of ALIGNMENT and the largest is always CLASS_MAX
+#define CLASS_MAX 4096
+#define MAX_CLASSES 40
+
 static void *base;        
-static size_t used;     
-
-typedef struct Metadata {
-  size_t size;                
-  int used;                  
-  struct Metadata *next_free; 
-  struct Metadata *prev;      
-  struct Metadata *next;      
+static size_t heap_size = MAX_HEAP_SIZE;  // bytes from base the regions and slabs divide
+
+// Headers link blocks through link_t fields, read with PTR and written with
+// LINK. Built with -DCOMPACT_HEADERS (make clean && make
+// DEFINES=-DCOMPACT_HEADERS), a link is the block's 16-byte granule
+// number counted from base plus one (0 for NULL) and the size a 32-bit byte
+// count, which the 128 MiB heap never outgrows: headers shrink from 48 bytes
+// to 32 (28 padded to keep payloads aligned), at a shift and add per link.
+#ifdef COMPACT_HEADERS
+typedef uint32_t link_t;
+typedef uint32_t size_field_t;
+#define PTR(link) link_ptr(link)
+#define LINK(ptr) ptr_link(ptr)
+#define HEADER_ALIGN __attribute__((aligned(ALIGNMENT)))
+#else
+typedef struct Metadata *link_t;
+typedef size_t size_field_t;
+#define PTR(link) (link)
+#define LINK(ptr) (ptr)
+#define HEADER_ALIGN
+#endif
+
+typedef struct HEADER_ALIGN Metadata {
+  size_field_t size;                
+  unsigned char used;                  
+  unsigned char region;       // index into regions[]
+  unsigned short site;        // index into sites[] of the allocating call site, or 0
+  union {
+    unsigned int born;        // ticks when allocated
+    unsigned int slot;        // while free: position in its region's size index, or NO_SLOT
+    unsigned int handle;      // when used is MOVABLE: the block's handle
+  };
+  link_t next_free; 
+  link_t prev_free; 
+  link_t prev;      
+  link_t next;      
 } Metadata;
+_Static_assert(sizeof(Metadata) % ALIGNMENT == 0, "headers must keep blocks aligned");
+
+#ifdef COMPACT_HEADERS
+static inline Metadata *link_ptr(link_t link) {
+  return link ? (Metadata *)((char *)base + (size_t)(link - 1) * ALIGNMENT) : NULL;
+}
+
+static inline link_t ptr_link(const Metadata *block) {
+  return block ? (link_t)(((const char *)block - (const char *)base) / ALIGNMENT + 1) : 0;
+}
+#endif
+
+// used is 0 for a free block, 1 for a used one, MOVABLE for one allocated by halloc
+#define MOVABLE 2
+
+// A stretch of the heap growing away from one fixed end. Blocks are chained in
+// address order within a region; the chain never crosses into another region.
+typedef struct Region {
+  char *start;          // fixed end: lowest address, or one past the highest if down
+  int down;             // grows toward lower addresses
+  size_t span;          // bytes available to this region and its pair together
+  struct Region *pair;  // region growing toward this one from the far end, if any
+  size_t used;          // bytes taken from start
+  size_t peak;          // most bytes taken from start since allocator_reset; beyond that memory is untouched
+  size_t resident;      // with "thp", bytes from start not known to be given back to the system
+  Metadata *last;       // block at the growing end
+  Metadata *head;       // free list
+  Metadata *bins[MAX_CLASSES];  // with size classes, free blocks filed by the largest class they hold
+  uint64_t full_bins;   // bit c set when bins[c] is non-empty
+  Metadata *rover;      // next-fit resumes here; a free block or NULL
+  size_t unmerged;      // frees since the last coalescing pass, under deferred coalescing
+} Region;
+
+enum { LOW, HIGH, LONG_TERM, PERM, NREGIONS };
+static Region regions[NREGIONS];
+
+// With "oob:N", requests up to N bytes come from slab pages at the top of the
+// heap instead: each page is cut into equal slots, packed back to back with no
+// headers, and its metadata lives out of band in a dense table indexed by page
+// number, holding the slot size and a bitmap of the slots in use. Finding a
+// slot or freeing one reads only the table, never the payloads. The slabs
+// take the top eighth of the heap, so the table is sized for the largest one.
+#define SLAB_PAGES (MAX_HEAP_SIZE / 8 / PAGE_SIZE)
+#define SLAB_MAX 1024
+#define SLAB_WORDS (PAGE_SIZE / ALIGNMENT / 64)
+
+typedef struct SlabPage {
+  unsigned short slot;        // slot size in bytes, or 0 while the page is empty
+  unsigned short nfree;       // slots not in use
+  int prev, next;             // neighbouring pages on its partial or empty list; -1 ends
+  uint64_t used[SLAB_WORDS];  // bit per slot in use; bits past the last slot stay set
+  uint32_t retired[PAGE_SIZE / ALIGNMENT];  // per 16 bytes: a retired slot's link, see retire_link
+} SlabPage;
+
+// One slot size's pages with a free slot, on a cache line of its own so
+// that threads working on different sizes under "binlock" do not share it
+typedef struct __attribute__((aligned(CACHE_LINE))) SlabClass {
+  pthread_mutex_t lock;  // with "binlock": held while touching this class's pages
+  int partial;           // list of pages with a free slot
+  size_t mallocs;        // slots handed out, for allocator_stats
+  size_t waste;          // bytes added rounding requests up to the slot size
+} SlabClass;
+
+static struct {
+  char *start;   // first page, or NULL without slabs
+  int limit;     // pages the slab area holds
+  _Atomic int pages;  // pages carved off the tail so far; they stay counted in the footprint
+  int empty;     // list of carved pages holding nothing
+  pthread_mutex_t pool;  // with "binlock": held while touching pages or empty
+  SlabClass cls[SLAB_MAX / ALIGNMENT + 1];  // by slot size / ALIGNMENT
+  SlabPage page[SLAB_PAGES];
+} slabs;
+
+// With "lock", any thread may call in: one recursive lock covers everything.
+// With "binlock", the heap keeps that lock, but each slab class has its own
+// and the pool of slab pages another, so small requests of different sizes
+// go ahead together. Locks are taken heap first, then class, then pool.
+enum { LOCK_NONE, LOCK_ONE, LOCK_BINS };
+static pthread_mutex_t heap_lock;
+static _Atomic size_t lock_waits;  // times a thread found the lock it wanted taken
+
+// With "bump", each thread hands out small requests from a page of its own
+// per slot size by bumping an index, taking no lock and no atomic. The page
+// starts with every slot marked used, so frees from any thread put slots
+// back the usual way, and nothing else can hand out a slot not yet bumped
+// to. Fresh pages come off the slab area's tail BUMP_CHUNK at a time.
+#define BUMP_CHUNK 8
+typedef struct BumpState {
+  size_t resets;      // the allocator_reset this state belongs to
+  int slot;           // this thread's index, or -1
+  int page[SLAB_MAX / ALIGNMENT + 1];              // page bumped from per slot size, or -1
+  unsigned short next[SLAB_MAX / ALIGNMENT + 1];   // slots bumped from it
+  int stash, stash_end;  // carved pages not yet bumped from
+} BumpState;
+static _Thread_local BumpState bumping;
+// bump allocations, counted by each thread for allocator_stats
+static struct __attribute__((aligned(CACHE_LINE))) {
+  size_t mallocs;
+  size_t waste;
+} bump_counts[MAX_THREADS];
+
+static allocator_stats stats;
+static _Atomic size_t footprint;       // bytes the regions and slab pages take right now
+static _Atomic size_t footprint_peak;  // most since allocator_reset, for stats.peak_footprint
+
+// Handle blocks: handles[h] says where block h is and how often it is pinned.
+// Unused entries chain through next from free_handle; entry 0 is never used.
+#define HANDLES (64 * 1024)
+static struct {
+  Metadata *block;   // or NULL while the handle is unused
+  unsigned int pins;
+  unsigned int next;
+} handles[HANDLES];
+static unsigned int free_handle;  // an unused handle, or 0
+static unsigned int new_handles;  // handles below this have been given out
+
+static void *free_queue[FREE_QUEUE_MAX];  // blocks myfree has queued, oldest first
+static _Atomic size_t queued;  // changed under the heap lock; read without it to see if a drain is due
+
+// Epoch-based reclamation. A block passed to myfree_deferred waits on the
+// lock-free stack for the epoch it was retired in (mod 3), linked through a
+// word outside its payload, which threads still inside may be reading. Once every thread inside ebr_enter has seen the epoch two past
+// that, the stack moves to ebr_ready, and the next allocation frees it in a
+// batch. Each thread's slot holds its epoch << 1, plus 1 while inside.
+static _Atomic size_t ebr_epoch;
+static _Atomic size_t ebr_local[MAX_THREADS];
+static _Atomic(void *) ebr_retired[3];
+static _Atomic(void *) ebr_ready;
+static _Atomic size_t ebr_pending;       // bytes retired and not yet freed
+static _Atomic size_t ebr_pending_peak;
+static _Atomic size_t ebr_advances;
+static _Thread_local size_t ebr_retirements;
+static _Thread_local size_t ebr_exits;  // since this thread last tried to advance
+
+// Each thread using ebr_enter or bump pages gets an index below MAX_THREADS,
+// valid until the next allocator_reset or until the thread exits, when
+// slot_key's destructor gives it back for another thread to take
+static _Atomic size_t resets;         // allocator_resets so far
+static _Atomic size_t thread_slots;   // indexes handed out since the last one
+static _Atomic uint64_t idle_slots[MAX_THREADS / 64];  // bit per index given back
+static pthread_key_t slot_key;
+static _Thread_local int my_slot = -1;
+static _Thread_local size_t my_slot_resets;
+
+static int backlog();
+static void drain_frees();
+static void ebr_advance();
+
+static int heap_zeroed;  // memory untouched since allocator_reset reads as zero
+static _Thread_local int fresh;  // this thread's last block was carved from untouched memory
+
+// Per-call-site history for lifetime prediction. Lifetimes are measured in
+// ticks, one per allocation; slot 0 collects sites that did not fit.
+#define SITES 256
+#define SITE_WARMUP 32
+static struct {
+  const void *pc;
+  size_t allocs;
+  size_t frees;
+  size_t lifetime_sum;  // ticks between allocation and free, over all frees
+} sites[SITES];
+static unsigned int ticks;
+static unsigned int color;  // cache-line offset to give the next large block, before % COLORS
+
+static size_t class_size[MAX_CLASSES];
+static int nclasses;
+static int binning;          // size classes in use since the last allocator_reset
+static int classes_pinned;   // class table given by allocator_set_size_classes
+static unsigned char class_ceil[CLASS_MAX / 8 + 1];  // smallest class holding 8*i bytes
+static size_t size_hist[CLASS_MAX / 8 + 1];  // small requests seen while learning, by 8-byte bucket
+static size_t hist_seen;
+
+// picks a free block able to hold size bytes, or NULL to grow the heap
+typedef Metadata *(*fit_fn)(Region *r, size_t size);
+// links a newly freed block into the free list
+typedef void (*insert_fn)(Metadata *block);
+
+static Metadata *first_fit(Region *r, size_t size);
+static Metadata *next_fit(Region *r, size_t size);
+static Metadata *best_fit(Region *r, size_t size);
+static Metadata *good_fit(Region *r, size_t size);
+static void insert_lifo(Metadata *block);
+static void insert_addr(Metadata *block);
+
+static const struct { const char *name; fit_fn find; } fits[] = {
+  { "first", first_fit },
+  { "next", next_fit },
+  { "best", best_fit },
+  { "good", good_fit },
+  { NULL, NULL }
+};
+
+static const struct { const char *name; insert_fn insert; } orders[] = {
+  { "lifo", insert_lifo },
+  { "addr", insert_addr },
+  { NULL, NULL }
+};
+
+typedef struct Policy {
+  fit_fn find;
+  insert_fn insert;
+  int deferred;  // coalesce only when a search comes up empty
+  size_t good_fit_limit;  // fitting candidates good-fit compares before settling
+  size_t high_threshold;  // requests at least this big go to HIGH; 0 keeps everything LOW
+  int segregate;          // HIGH is searched best-fit whatever the chosen fit
+  int hints;              // honour mymalloc_hint by giving each lifetime its own region
+  size_t long_lifetime;   // predict sites whose blocks live this many ticks as long-lived; 0 is off
+  int classes;            // round small requests up to a size class and bin free blocks by class
+  size_t learn_window;    // small requests to observe before re-deriving the classes; 0 is off
+  size_t color_threshold; // requests at least this big get rotating cache-line offsets; 0 is off
+  size_t stream_threshold; // realloc moves at least this big use non-temporal stores; 0 is off
+  size_t oob_limit;       // requests up to this big come from slab pages; 0 is off
+  int hugepages;          // back the heap with transparent huge pages and give whole ones back
+  int prefault;           // touch every page of the heap at allocator_reset
+  int index;              // search a packed array of free-list sizes instead of the list
+  size_t free_queue;      // myfree queues up to this many blocks for later; 0 frees at once
+  int locking;            // LOCK_NONE, LOCK_ONE or LOCK_BINS
+  int bump;               // each thread bumps small requests from slab pages of its own
+} Policy;
+
+// first,lifo,eager with everything else off; a spec changes only what it names
+static const Policy defaults = {
+  .find = first_fit,
+  .insert = insert_lifo,
+  .good_fit_limit = 8,
+  .locking = LOCK_NONE,
+};
+static Policy policy;  // set by allocator_init
+
+// the lock guarding the slab page pool, or NULL when callers take turns
+static pthread_mutex_t *pool_lock() {
+  return policy.locking == LOCK_BINS ? &slabs.pool : policy.locking ? &heap_lock : NULL;
+}
+
+// the lock guarding a slab class's pages
+static pthread_mutex_t *class_lock(SlabClass *cls) {
+  return policy.locking == LOCK_BINS ? &cls->lock : policy.locking ? &heap_lock : NULL;
+}
+
+static void lock(pthread_mutex_t *m) {
+  if (m && pthread_mutex_trylock(m)) {
+    atomic_fetch_add_explicit(&lock_waits, 1, memory_order_relaxed);
+    pthread_mutex_lock(m);
+  }
+}
+
+static void unlock(pthread_mutex_t *m) {
+  if (m) {
+    pthread_mutex_unlock(m);
+  }
+}
+
+static void heap_enter() {
+  lock(policy.locking ? &heap_lock : NULL);
+}
+
+static void heap_leave() {
+  unlock(policy.locking ? &heap_lock : NULL);
+}
+
+// an index some exited thread gave back, or -1
+static int idle_slot() {
+  for (int w = 0; w < MAX_THREADS / 64; w += 1) {
+    uint64_t bits = atomic_load(&idle_slots[w]);
+    while (bits && !atomic_compare_exchange_weak(&idle_slots[w], &bits, bits & (bits - 1))) {
+    }
+    if (bits) {
+      return w * 64 + __builtin_ctzll(bits);
+    }
+  }
+  return -1;
+}
+
+// this thread's index, claimed on first use after each allocator_reset; -1 while all are taken
+static int thread_slot() {
+  if (my_slot < 0 || my_slot_resets != resets) {
+    int slot = idle_slot();
+    if (slot < 0) {
+      size_t next = atomic_fetch_add(&thread_slots, 1);
+      if (next >= MAX_THREADS) {
+        atomic_fetch_sub(&thread_slots, 1);
+        my_slot = -1;
+        return -1;
+      }
+      slot = next;
+    }
+    my_slot = slot;
+    my_slot_resets = resets;
+    pthread_setspecific(slot_key, &my_slot);
+  }
+  return my_slot;
+}
+
+// slot_key's destructor: an exiting thread moves the epoch on for what it
+// retired, as no later ebr_exit of its own will, then leaves its index to
+// the next thread, unless an allocator_reset has already taken them all back
+static void release_slot(void *unused) {
+  (void)unused;
+  if (my_slot < 0 || my_slot_resets != resets) {
+    return;
+  }
+  atomic_store(&ebr_local[my_slot], 0);
+  if (ebr_retirements) {
+    ebr_retirements = 0;
+    ebr_advance();
+  }
+  atomic_fetch_or(&idle_slots[my_slot / 64], (uint64_t)1 << my_slot % 64);
+  my_slot = -1;
+}
+
+int allocator_set_policy(const char *spec) {
+  Policy next = defaults;
+  char token[32];
+
+  while (spec && *spec) {
+    size_t len = strcspn(spec, ",");
+    if (len == 0 || len >= sizeof(token)) {
+      return -1;
+    }
+    memcpy(token, spec, len);
+    token[len] = '\0';
+    spec += len + (spec[len] == ',');
+
+    char *arg = strchr(token, ':');
+    if (arg) {
+      *arg++ = '\0';
+      size_t value = strtoul(arg, NULL, 10);
+      if (value == 0) {
+        return -1;
+      } else if (!strcmp(token, "good")) {
+        next.good_fit_limit = value;
+      } else if (!strcmp(token, "bidir") || !strcmp(token, "segregate")) {
+        next.high_threshold = value;
+      } else if (!strcmp(token, "predict")) {
+        next.long_lifetime = value;
+      } else if (!strcmp(token, "learn")) {
+        next.learn_window = value;
+      } else if (!strcmp(token, "color")) {
+        next.color_threshold = value;
+      } else if (!strcmp(token, "stream")) {
+        next.stream_threshold = value;
+      } else if (!strcmp(token, "oob") && value <= SLAB_MAX) {
+        next.oob_limit = value;
+      } else if (!strcmp(token, "queue") && value <= FREE_QUEUE_MAX) {
+        next.free_queue = value;
+      } else {
+        return -1;
+      }
+    }
+    int known = 0;
+    for (int i = 0; fits[i].name; i += 1) {
+      if (!strcmp(token, fits[i].name)) { next.find = fits[i].find; known = 1; }
+    }
+    for (int i = 0; orders[i].name; i += 1) {
+      if (!strcmp(token, orders[i].name)) { next.insert = orders[i].insert; known = 1; }
+    }
+    if (!strcmp(token, "eager")) { next.deferred = 0; known = 1; }
+    if (!strcmp(token, "deferred")) { next.deferred = 1; known = 1; }
+    if (!strcmp(token, "bidir")) { next.high_threshold = arg ? next.high_threshold : 256; known = 1; }
+    if (!strcmp(token, "segregate")) { next.high_threshold = arg ? next.high_threshold : 1024; next.segregate = 1; known = 1; }
+    if (!strcmp(token, "hints")) { next.hints = 1; known = 1; }
+    if (!strcmp(token, "predict")) { next.long_lifetime = arg ? next.long_lifetime : 1024; known = 1; }
+    if (!strcmp(token, "classes")) { next.classes = 1; known = 1; }
+    if (!strcmp(token, "learn")) { next.learn_window = arg ? next.learn_window : 1024; next.classes = 1; known = 1; }
+    if (!strcmp(token, "color")) { next.color_threshold = arg ? next.color_threshold : 4096; known = 1; }
+    if (!strcmp(token, "stream")) { next.stream_threshold = arg ? next.stream_threshold : 1024 * 1024; known = 1; }
+    if (!strcmp(token, "oob")) { next.oob_limit = arg ? next.oob_limit : 256; known = 1; }
+    if (!strcmp(token, "thp")) { next.hugepages = 1; known = 1; }
+    if (!strcmp(token, "prefault")) { next.prefault = 1; known = 1; }
+    if (!strcmp(token, "index")) { next.index = 1; known = 1; }
+    if (!strcmp(token, "queue")) { next.free_queue = arg ? next.free_queue : 256; known = 1; }
+    if (!strcmp(token, "lock")) { next.locking = LOCK_ONE; known = 1; }
+    if (!strcmp(token, "binlock")) { next.locking = LOCK_BINS; known = 1; }
+    if (!strcmp(token, "bump")) { next.bump = 1; known = 1; }
+    if (!known) {
+      return -1;
+    }
+  }
+  // blocks queued under the old policy are freed by its rules
+  drain_frees();
+  policy = next;
+  return 0;
+}
+
+static size_t round_up(size_t size, size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+// the bytes a block for a request of size bytes holds: never 0, so that even
+// mymalloc(0) has room for the link myfree_deferred threads through it
+static size_t payload_size(size_t size) {
+  return size ? round_up(size, ALIGNMENT) : ALIGNMENT;
+}
+
+static int compare_sizes(const void *a, const void *b) {
+  size_t x = *(const size_t *)a, y = *(const size_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// install sizes (rounded up to multiples of ALIGNMENT, sorted, deduplicated, capped by CLASS_MAX) as the class table
+static void set_classes(const size_t *sizes, size_t n) {
+  size_t sorted[MAX_CLASSES];
+  n = n < MAX_CLASSES - 1 ? n : MAX_CLASSES - 1;
+  for (size_t i = 0; i < n; i += 1) {
+    sorted[i] = round_up(sizes[i], ALIGNMENT);
+  }
+  sorted[n++] = CLASS_MAX;
+  qsort(sorted, n, sizeof(size_t), compare_sizes);
+  nclasses = 0;
+  for (size_t i = 0; i < n; i += 1) {
+    if (sorted[i] && sorted[i] <= CLASS_MAX && (nclasses == 0 || sorted[i] != class_size[nclasses - 1])) {
+      class_size[nclasses++] = sorted[i];
+    }
+  }
+  int c = 0;
+  for (size_t i = 0; i <= CLASS_MAX / 8; i += 1) {
+    while (class_size[c] < i * 8) {
+      c += 1;
+    }
+    class_ceil[i] = c;
+  }
+}
+
+// 16-byte steps to 128, then four classes per doubling
+static void default_classes() {
+  size_t sizes[MAX_CLASSES];
+  size_t n = 0;
+  for (size_t size = 16; size <= 128; size += 16) {
+    sizes[n++] = size;
+  }
+  for (size_t power = 128; power < CLASS_MAX; power *= 2) {
+    for (size_t k = 1; k <= 4; k += 1) {
+      sizes[n++] = power + k * power / 4;
+    }
+  }
+  set_classes(sizes, n);
+}
+
+size_t allocator_get_size_classes(size_t *out, size_t max) {
+  if (!binning) {
+    return 0;
+  }
+  for (int i = 0; i < nclasses && i < (int)max; i += 1) {
+    out[i] = class_size[i];
+  }
+  return nclasses;
+}
+
+int allocator_set_size_classes(const size_t *sizes, size_t n) {
+  for (size_t i = 0; i < n; i += 1) {
+    if (sizes[i] == 0 || sizes[i] > CLASS_MAX) {
+      return -1;
+    }
+  }
+  classes_pinned = n > 0;
+  if (classes_pinned) {
+    set_classes(sizes, n);
+  }
+  return 0;
+}
+
+// set up lo to grow up from start and hi down from start + span, sharing the space between
+static void pair_regions(Region *lo, Region *hi, char *start, size_t span) {
+  lo->start = start;
+  hi->start = start + span;
+  hi->down = 1;
+  lo->span = hi->span = span;
+  lo->resident = hi->resident = span;
+  lo->pair = hi;
+  hi->pair = lo;
+}
+
+// LOW and HIGH share the heap; with lifetime hints or prediction LONG_TERM and PERM take its upper half,
+// and with slabs the top eighth, in whole pages, is theirs
+static void layout() {
+  size_t lifetime_span = policy.hints || policy.long_lifetime ? heap_size / 2 / ALIGNMENT * ALIGNMENT : 0;
+  size_t slab_span = policy.oob_limit ? heap_size / 8 / PAGE_SIZE * PAGE_SIZE : 0;
+  memset(regions, 0, sizeof(regions));
+  pair_regions(&regions[LOW], &regions[HIGH], base, heap_size - lifetime_span - slab_span);
+  pair_regions(&regions[LONG_TERM], &regions[PERM], regions[HIGH].start, lifetime_span);
+  slabs.start = slab_span ? regions[PERM].start : NULL;
+  slabs.limit = slab_span / PAGE_SIZE;
+  slabs.pages = 0;
+  slabs.empty = -1;
+  for (int i = 0; i <= SLAB_MAX / ALIGNMENT; i += 1) {
+    slabs.cls[i].partial = -1;
+    slabs.cls[i].mallocs = slabs.cls[i].waste = 0;
+  }
+}
+
+// Non-temporal copies for large realloc moves: the stores bypass the cache,
+// so moving a multi-megabyte block does not evict the caller's working set.
+// Each streams whole aligned vectors and leaves the ragged ends to memcpy.
+typedef void (*copy_fn)(void *to, const void *from, size_t n);
+static copy_fn stream_copy;  // the best kernel this CPU runs, or NULL
+
+#if defined(__x86_64__)
+__attribute__((target("avx512f")))
+static void stream_copy_avx512(void *to, const void *from, size_t n) {
+  char *d = to;
+  const char *s = from;
+  size_t head = -(uintptr_t)d % 64 < n ? -(uintptr_t)d % 64 : n;
+  memcpy(d, s, head);
+  for (d += head, s += head, n -= head; n >= 64; d += 64, s += 64, n -= 64) {
+    _mm512_stream_si512((void *)d, _mm512_loadu_si512(s));
+  }
+  memcpy(d, s, n);
+  _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void stream_copy_avx2(void *to, const void *from, size_t n) {
+  char *d = to;
+  const char *s = from;
+  size_t head = -(uintptr_t)d % 32 < n ? -(uintptr_t)d % 32 : n;
+  memcpy(d, s, head);
+  for (d += head, s += head, n -= head; n >= 32; d += 32, s += 32, n -= 32) {
+    _mm256_stream_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+  }
+  memcpy(d, s, n);
+  _mm_sfence();
+}
+
+static void stream_copy_sse2(void *to, const void *from, size_t n) {
+  char *d = to;
+  const char *s = from;
+  size_t head = -(uintptr_t)d % 16 < n ? -(uintptr_t)d % 16 : n;
+  memcpy(d, s, head);
+  for (d += head, s += head, n -= head; n >= 16; d += 16, s += 16, n -= 16) {
+    _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+  }
+  memcpy(d, s, n);
+  _mm_sfence();
+}
+#endif
+
+// With "index", each region keeps the size of every block on its free list (not
+// in a bin) in a packed array beside a pointer to the block, so a search reads
+// 4 bytes per candidate, eight to a vector compare, instead of a header per
+// cache miss. Slots are unordered: removal moves the last slot into the gap.
+// Past INDEX_SLOTS free blocks the region gives up on its index until
+// allocator_reset and searches walk the list again.
+#define INDEX_SLOTS (128 * 1024)
+#define NO_SLOT 0xffffffffu
+typedef struct SizeIndex {
+  uint32_t size[INDEX_SLOTS];
+  Metadata *block[INDEX_SLOTS];
+  size_t count;  // slots in use
+  int lost;      // overflowed; no longer covers the free list
+} SizeIndex;
+static SizeIndex size_index[NREGIONS];
+static int indexing;  // size indexes in use since the last allocator_reset
+
+// first slot from i on, before n, whose size is at least lo and below limit (at most INT32_MAX)
+typedef size_t (*find_slot_fn)(const uint32_t *size, size_t i, size_t n, uint32_t lo, uint32_t limit);
+// smallest size among the first n slots that is at least lo, or UINT32_MAX
+typedef uint32_t (*least_size_fn)(const uint32_t *size, size_t n, uint32_t lo);
+
+static size_t find_slot_scalar(const uint32_t *size, size_t i, size_t n, uint32_t lo, uint32_t limit) {
+  while (i < n && (size[i] < lo || size[i] >= limit)) {
+    i += 1;
+  }
+  return i;
+}
+
+static uint32_t least_size_scalar(const uint32_t *size, size_t n, uint32_t lo) {
+  uint32_t least = UINT32_MAX;
+  for (size_t i = 0; i < n; i += 1) {
+    if (size[i] >= lo && size[i] < least) {
+      least = size[i];
+    }
+  }
+  return least;
+}
+
+#if defined(__x86_64__)
+// sizes never reach 2^31, so the signed compares AVX2 offers are safe
+__attribute__((target("avx2")))
+static size_t find_slot_avx2(const uint32_t *size, size_t i, size_t n, uint32_t lo, uint32_t limit) {
+  __m256i above = _mm256_set1_epi32(lo - 1);
+  __m256i below = _mm256_set1_epi32(limit);
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(size + i));
+    __m256i in = _mm256_and_si256(_mm256_cmpgt_epi32(v, above), _mm256_cmpgt_epi32(below, v));
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(in));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return find_slot_scalar(size, i, n, lo, limit);
+}
+
+__attribute__((target("avx2")))
+static uint32_t least_size_avx2(const uint32_t *size, size_t n, uint32_t lo) {
+  __m256i above = _mm256_set1_epi32(lo - 1);
+  __m256i least = _mm256_set1_epi32(-1);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(size + i));
+    __m256i small = _mm256_cmpgt_epi32(above, v);  // too small: treat as UINT32_MAX
+    least = _mm256_min_epu32(least, _mm256_or_si256(v, small));
+  }
+  uint32_t lanes[8];
+  _mm256_storeu_si256((__m256i *)lanes, least);
+  uint32_t tail = least_size_scalar(size + i, n - i, lo);
+  for (int k = 0; k < 8; k += 1) {
+    tail = lanes[k] < tail ? lanes[k] : tail;
+  }
+  return tail;
+}
+#endif
+
+static find_slot_fn find_slot = find_slot_scalar;
+static least_size_fn least_size = least_size_scalar;
+
+static void pick_kernels() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    find_slot = find_slot_avx2;
+    least_size = least_size_avx2;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    stream_copy = stream_copy_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    stream_copy = stream_copy_avx2;
+  } else {
+    stream_copy = stream_copy_sse2;
+  }
+#endif
+}
 
-static Metadata *head = NULL; 
-static Metadata *last = NULL;     
+void allocator_set_heap_size(size_t size) {
+  size = size < MAX_HEAP_SIZE ? size : MAX_HEAP_SIZE;
+  heap_size = size / ALIGNMENT * ALIGNMENT;
+}
 
 void allocator_init(void *newbase) {
+  pthread_mutexattr_t recursive;
+  pthread_mutexattr_init(&recursive);
+  pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&heap_lock, &recursive);
+  pthread_mutex_init(&slabs.pool, NULL);
+  pthread_key_create(&slot_key, release_slot);
+  for (int i = 0; i <= SLAB_MAX / ALIGNMENT; i += 1) {
+    pthread_mutex_init(&slabs.cls[i].lock, NULL);
+  }
   base = newbase;
-  used = 0;
-  head = NULL;
-  last= NULL;
+  pick_kernels();
+  if (allocator_set_policy(getenv("ALLOCATOR_POLICY")) < 0) {
+    allocator_set_policy(NULL);
+  }
+  const char *pinned = getenv("ALLOCATOR_CLASSES");
+  if (pinned) {
+    size_t sizes[MAX_CLASSES];
+    size_t n = 0;
+    char *end;
+    while (n < MAX_CLASSES && (sizes[n] = strtoul(pinned, &end, 10)) && end != pinned) {
+      n += 1;
+      pinned = end + (*end == ',');
+    }
+    allocator_set_size_classes(sizes, n);
+  }
+  allocator_reset();
+}
+
+// ask for huge pages and, if wanted, fault the whole heap in now rather than on first use
+static void back_heap() {
+  if (policy.hugepages) {
+    madvise(base, heap_size, MADV_HUGEPAGE);
+  }
+  if (policy.prefault) {
+    for (volatile char *p = base; p < (char *)base + heap_size; p += PAGE_SIZE) {
+      *p = *p;
+    }
+  }
 }
 
 void allocator_reset() {
-  used = 0;
-  head = NULL;
-  last = NULL;
+  layout();
+  back_heap();
+  memset(sites, 0, sizeof(sites));
+  ticks = 0;
+  color = 0;
+  heap_zeroed = 0;
+  binning = policy.classes || classes_pinned;
+  indexing = policy.index;
+  for (int i = 0; i < NREGIONS; i += 1) {
+    size_index[i].count = 0;
+    size_index[i].lost = 0;
+  }
+  if (!classes_pinned) {
+    default_classes();
+  }
+  memset(size_hist, 0, sizeof(size_hist));
+  hist_seen = 0;
+  memset(&stats, 0, sizeof(stats));
+  footprint = footprint_peak = 0;
+  free_handle = 0;
+  new_handles = 1;
+  queued = 0;
+  thread_slots = 0;
+  memset(idle_slots, 0, sizeof(idle_slots));
+  resets += 1;
+  memset(bump_counts, 0, sizeof(bump_counts));
+  for (int i = 0; i < MAX_THREADS; i += 1) {
+    ebr_local[i] = 0;
+  }
+  ebr_retired[0] = ebr_retired[1] = ebr_retired[2] = NULL;
+  ebr_ready = NULL;
+  ebr_pending = ebr_pending_peak = ebr_advances = 0;
+  lock_waits = 0;
+}
+
+int allocator_thread_safe() {
+  return policy.locking != LOCK_NONE;
+}
+
+void allocator_set_zeroed() {
+  heap_zeroed = 1;
+}
+
+void allocator_get_stats(allocator_stats *out) {
+  *out = stats;
+  for (int i = 0; i <= SLAB_MAX / ALIGNMENT; i += 1) {
+    out->mallocs += slabs.cls[i].mallocs;
+    out->rounding_waste += slabs.cls[i].waste;
+  }
+  for (int i = 0; i < MAX_THREADS; i += 1) {
+    out->mallocs += bump_counts[i].mallocs;
+    out->rounding_waste += bump_counts[i].waste;
+  }
+  out->peak_footprint = footprint_peak;
+  out->retired_peak = ebr_pending_peak;
+  out->epoch_advances = ebr_advances;
+  out->lock_waits = lock_waits;
+}
+
+static Region *region_of(Metadata *block) {
+  return &regions[block->region];
+}
+
+static char *end_of(Metadata *block) {
+  return (char *)(block + 1) + block->size;
+}
+
+// the growing end of its region: nothing beyond it but unused space
+static int at_tail(Region *r, Metadata *block) {
+  return r->down ? PTR(block->prev) == NULL : PTR(block->next) == NULL;
+}
+
+// Add delta bytes (wrapping around to take them away) to the footprint and
+// keep its peak. Slab pages count with their table entries. Under "binlock"
+// the slab side calls this without the heap lock, so it touches no region.
+static void note_footprint(size_t delta) {
+  size_t now = atomic_fetch_add(&footprint, delta) + delta;
+  size_t peak = atomic_load(&footprint_peak);
+  while (now > peak && !atomic_compare_exchange_weak(&footprint_peak, &peak, now)) {
+  }
+}
+
+// after r grows by delta bytes, with the heap lock held: move its high-water marks
+static void note_growth(Region *r, size_t delta) {
+  note_footprint(delta);
+  if (r->used > r->peak) {
+    r->peak = r->used;
+  }
+  if (r->used > r->resident) {
+    r->resident = r->used;
+  }
+}
+
+// the bin a free block of this size belongs in, or the region's free list
+static Metadata **list_for(Region *r, size_t size) {
+  if (binning && size >= class_size[0] && size <= CLASS_MAX) {
+    int c = class_ceil[(size + 7) / 8];
+    return &r->bins[class_size[c] == size ? c : c - 1];
+  }
+  return &r->head;
+}
+
+// keep full_bins in step after list, which may be a bin, changed
+static void note_bin(Region *r, Metadata **list) {
+  if (list != &r->head) {
+    uint64_t bit = (uint64_t)1 << (list - r->bins);
+    r->full_bins = *list ? r->full_bins | bit : r->full_bins & ~bit;
+  }
+}
+
+static void index_add(Region *r, Metadata *block) {
+  block->slot = NO_SLOT;
+  if (!indexing || list_for(r, block->size) != &r->head) {
+    return;
+  }
+  SizeIndex *x = &size_index[r - regions];
+  if (x->count == INDEX_SLOTS) {
+    x->lost = 1;
+  }
+  if (!x->lost) {
+    x->size[x->count] = block->size;
+    x->block[x->count] = block;
+    block->slot = x->count++;
+  }
+}
+
+static void index_drop(Region *r, Metadata *block) {
+  if (block->slot != NO_SLOT) {
+    SizeIndex *x = &size_index[r - regions];
+    x->count -= 1;
+    x->size[block->slot] = x->size[x->count];
+    x->block[block->slot] = x->block[x->count];
+    x->block[block->slot]->slot = block->slot;
+  }
+}
+
+static void unlink_free(Region *r, Metadata **list, Metadata *block) {
+  index_drop(r, block);
+  if (block->prev_free) {
+    PTR(block->prev_free)->next_free = block->next_free;
+  } else {
+    *list = PTR(block->next_free);
+    note_bin(r, list);
+  }
+  if (block->next_free) {
+    PTR(block->next_free)->prev_free = block->prev_free;
+  }
+  if (r->rover == block) {
+    r->rover = PTR(block->next_free);
+  }
 }
 
 void remove_from_list(Metadata *block) {
-  Metadata *prev_free = NULL;
-  Metadata *curr = head;
-  while (curr) {
-    if (curr == block) {
-      if (prev_free) {
-        prev_free->next_free = curr->next_free;
-      } else {
-        head = curr->next_free;
-      }
-      break;
-    }
-    prev_free = curr;
-    curr = curr->next_free;
+  Region *r = region_of(block);
+  unlink_free(r, list_for(r, block->size), block);
+}
+
+// link block into its list between before and after (either may be NULL)
+static void link_free(Metadata *block, Metadata *before, Metadata *after) {
+  index_add(region_of(block), block);
+  block->prev_free = LINK(before);
+  block->next_free = LINK(after);
+  if (before) {
+    before->next_free = LINK(block);
+  } else {
+    Region *r = region_of(block);
+    Metadata **list = list_for(r, block->size);
+    *list = block;
+    note_bin(r, list);
+  }
+  if (after) {
+    after->prev_free = LINK(block);
+  }
+}
+
+static void insert_lifo(Metadata *block) {
+  link_free(block, NULL, region_of(block)->head);
+}
+
+static void insert_addr(Metadata *block) {
+  Metadata *before = NULL;
+  Metadata *after = region_of(block)->head;
+  while (after && after < block) {
+    before = after;
+    after = PTR(after->next_free);
   }
+  link_free(block, before, after);
 }
 
 void add_to_list(Metadata *block) {
-  block->next_free = head;
-  head = block;
+  Region *r = region_of(block);
+  Metadata **list = list_for(r, block->size);
+  if (list == &r->head) {
+    policy.insert(block);
+  } else {
+    link_free(block, NULL, *list);
+  }
+}
+
+// whether a free block of have bytes, cut down to want, leaves a remainder
+// big enough to be worth listing: one too small for most requests only
+// lengthens the free list that searches walk past it
+static int worth_splitting(size_t have, size_t want) {
+  return have >= want + sizeof(Metadata) + MIN_SPLIT;
 }
 
 void split(Metadata *block, size_t size) {
   Metadata *split_block = (Metadata *)((char *)(block + 1) + size);
   split_block->size = block->size - size - sizeof(Metadata);
   split_block->used = 0;
+  split_block->region = block->region;
 
-  split_block->prev = block;
+  split_block->prev = LINK(block);
   split_block->next = block->next;
   if (split_block->next) {
-    split_block->next->prev = split_block;
-  } else {
-    last = split_block;
+    PTR(split_block->next)->prev = LINK(split_block);
+  } else if (!region_of(block)->down) {
+    region_of(block)->last = split_block;
   }
-  block->next = split_block;
+  block->next = LINK(split_block);
   add_to_list(split_block);
 
   block->size = size;
 }
 
+// take the block after block, which must be on no list, into it
+static void absorb_next(Metadata *block) {
+  Metadata *next_block = PTR(block->next);
+  block->size += sizeof(Metadata) + next_block->size;
+  block->next = next_block->next;
+  if (block->next) {
+    PTR(block->next)->prev = LINK(block);
+  } else if (!region_of(block)->down) {
+    region_of(block)->last = block;
+  }
+}
+
 void merge_next(Metadata *block) {
-  Metadata *next_block = block->next;
+  Metadata *next_block = PTR(block->next);
   if (next_block && !next_block->used) {
     remove_from_list(next_block);
-    block->size += sizeof(Metadata) + next_block->size;
-    block->next = next_block->next;
-    if (block->next) {
-      block->next->prev = block;
-    } else {
-      last = block;
-    }
+    absorb_next(block);
   }
 }
 
 Metadata *merge_prev(Metadata *block) {
-  Metadata *prev_block = block->prev;
+  Metadata *prev_block = PTR(block->prev);
   if (prev_block && !prev_block->used) {
     remove_from_list(prev_block);
     prev_block->size += sizeof(Metadata) + block->size;
     prev_block->next = block->next;
     if (prev_block->next) {
-      prev_block->next->prev = prev_block;
-    } else {
-      last = prev_block;
+      PTR(prev_block->next)->prev = LINK(prev_block);
+    } else if (!region_of(block)->down) {
+      region_of(block)->last = prev_block;
     }
     block = prev_block;
   }
   return block;
 }
 
-void *mymalloc(size_t size) {
-  size_t total_size = sizeof(Metadata) + size;
-  Metadata *prev_free = NULL;
-  Metadata *curr = head;
+static void note_search(size_t depth) {
+  stats.searches += 1;
+  stats.search_steps += depth;
+  if (depth > stats.max_search_depth) {
+    stats.max_search_depth = depth;
+  }
+}
+
+// first block on the free list that fits, scanning from start and wrapping to head
+static Metadata *scan_from(Region *r, Metadata *start, size_t size) {
+  Metadata *curr = start;
+  size_t depth = 0;
+  int wrapped = 0;
 
   while (curr) {
+    depth += 1;
     if (curr->size >= size) {
-      if (prev_free) {
-        prev_free->next_free = curr->next_free;
-      } else {
-        head = curr->next_free;
-      }
-      curr->used = 1;
-      if (curr->size >= size + sizeof(Metadata) + 8) {
-        split(curr, size);
-      }
-      return (void *)(curr + 1);
+      break;
+    }
+    curr = PTR(curr->next_free);
+    if (!curr && !wrapped && start != r->head) {
+      wrapped = 1;
+      curr = r->head;
+    }
+    if (wrapped && curr == start) {
+      curr = NULL;
     }
-    prev_free = curr;
-    curr = curr->next_free;
-  }
-  if (used + total_size > MAX_HEAP_SIZE) {
-    return NULL;  
   }
-  Metadata *meta = (Metadata *)((char *)base + used);
-  meta->size = size;
-  meta->used = 1;
-  meta->prev = last;
-  meta->next = NULL;
+  note_search(depth);
+  return curr;
+}
 
-  if (last) {
-    last->next = meta;
-  }
-  last = meta;
-  used += total_size;
-  return (void *)(meta + 1);
+static Metadata *first_fit(Region *r, size_t size) {
+  return scan_from(r, r->head, size);
 }
 
-void myfree(void *ptr) {
-  if (ptr == NULL) {
-    return; 
+static Metadata *next_fit(Region *r, size_t size) {
+  return scan_from(r, r->rover ? r->rover : r->head, size);
+}
+
+// smallest block that fits; stops early on an exact fit
+static Metadata *best_fit(Region *r, size_t size) {
+  Metadata *best = NULL;
+  size_t depth = 0;
+  for (Metadata *curr = r->head; curr; curr = PTR(curr->next_free)) {
+    depth += 1;
+    if (curr->size >= size && (!best || curr->size < best->size)) {
+      best = curr;
+      if (curr->size == size) {
+        break;
+      }
+    }
   }
-  Metadata *meta = (Metadata *)ptr - 1;
-  meta->used = 0;
+  note_search(depth);
+  return best;
+}
 
-  merge_next(meta);
-  meta = merge_prev(meta);
-  if (meta->next == NULL) {
-    if (meta->prev) {
-      meta->prev->next = NULL;
-      last = meta->prev;
-    } else {
-      last = NULL;
+// tightest of the first good_fit_limit blocks that fit; stops early on a block
+// too close in size to split, since nothing tighter could save more memory
+static Metadata *good_fit(Region *r, size_t size) {
+  Metadata *best = NULL;
+  size_t depth = 0;
+  size_t candidates = 0;
+  for (Metadata *curr = r->head; curr; curr = PTR(curr->next_free)) {
+    depth += 1;
+    if (curr->size < size) {
+      continue;
+    }
+    if (!best || curr->size < best->size) {
+      best = curr;
+      if (!worth_splitting(curr->size, size)) {
+        break;
+      }
+    }
+    candidates += 1;
+    if (candidates == policy.good_fit_limit) {
+      if (curr->next_free) {
+        stats.fit_limit_hits += 1;
+      }
+      break;
     }
-    used = (char *)meta - (char *)base;
-  } else {
-      add_to_list(meta);
   }
+  note_search(depth);
+  return best;
 }
 
-void *myrealloc(void *ptr, size_t size) {
+// The chosen fit over r's size index: the tightest of the first good_fit_limit
+// slots that fit for good fit, of all of them for best fit, and the first for
+// first and next fit (so in slot order, not list order). Like the list walks,
+// best fit stops at an exact fit and good fit at one too close to split.
+static Metadata *index_fit(Region *r, fit_fn find, size_t size) {
+  SizeIndex *x = &size_index[r - regions];
+  size_t i;
+  if (find == best_fit) {
+    uint32_t least = least_size(x->size, x->count, size);
+    i = least == UINT32_MAX ? x->count : find_slot(x->size, 0, x->count, least, least + 1);
+    note_search(x->count);
+    return i < x->count ? x->block[i] : NULL;
+  }
+  size_t limit = find == good_fit ? policy.good_fit_limit : 1;
+  size_t candidates = 0;
+  Metadata *best = NULL;
+  for (i = find_slot(x->size, 0, x->count, size, INT32_MAX); i < x->count;
+       i = find_slot(x->size, i + 1, x->count, size, INT32_MAX)) {
+    if (!best || x->size[i] < best->size) {
+      best = x->block[i];
+      if (!worth_splitting(best->size, size)) {
+        break;
+      }
+    }
+    if (++candidates == limit) {
+      break;
+    }
+  }
+  note_search(i < x->count ? i + 1 : x->count);
+  return best;
+}
+
+// look for a free block of at least size bytes in r's free list; under
+// "segregate" only large blocks live in HIGH, and there best fit wastes least
+static Metadata *search(Region *r, size_t size) {
+  fit_fn find = policy.segregate && r == &regions[HIGH] ? best_fit : policy.find;
+  if (indexing && !size_index[r - regions].lost) {
+    return index_fit(r, find, size);
+  }
+  return find(r, size);
+}
+
+// Under "thp", give every whole huge page more than one past the end of r
+// (and short of its pair) back to the system, so a shrinking heap returns
+// memory in the units that back it. Leaving one page spare stops a tail that
+// hovers about a boundary from faulting the same page in over and over. A
+// prefaulted heap keeps everything: the point of prefaulting is never to fault.
+static void release_huge(Region *r) {
+  size_t end = r->span - r->pair->used < r->resident ? r->span - r->pair->used : r->resident;
+  if (!policy.hugepages || policy.prefault || end <= r->used) {
+    return;
+  }
+  uintptr_t lo, hi;
+  if (r->down) {
+    hi = ((uintptr_t)r->start - r->used) / HUGE_PAGE * HUGE_PAGE - HUGE_PAGE;
+    lo = ((uintptr_t)r->start - end + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+  } else {
+    lo = ((uintptr_t)r->start + r->used + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE + HUGE_PAGE;
+    hi = ((uintptr_t)r->start + end) / HUGE_PAGE * HUGE_PAGE;
+  }
+  if (lo < hi && !madvise((void *)lo, hi - lo, MADV_DONTNEED)) {
+    stats.bytes_released += hi - lo;
+    r->resident = r->down ? (uintptr_t)r->start - hi : lo - (uintptr_t)r->start;
+  }
+}
+
+// release the free block at the growing end of r, and any free blocks it exposes
+static void trim_tail(Region *r, Metadata *meta) {
+  size_t used = r->used;
+  for (;;) {
+    if (r->down) {
+      r->last = PTR(meta->next);
+      if (r->last) {
+        r->last->prev = LINK(NULL);
+      }
+      r->used = r->start - end_of(meta);
+    } else {
+      r->last = PTR(meta->prev);
+      if (r->last) {
+        r->last->next = LINK(NULL);
+      }
+      r->used = (char *)meta - r->start;
+    }
+    if (!r->last || r->last->used) {
+      break;
+    }
+    meta = r->last;
+    remove_from_list(meta);
+  }
+  note_footprint(r->used - used);
+  release_huge(r);
+}
+
+// move every block in list that no longer belongs there to its proper list
+static void refile(Region *r, Metadata **list) {
+  Metadata *next;
+  for (Metadata *curr = *list; curr; curr = next) {
+    next = PTR(curr->next_free);
+    if (list_for(r, curr->size) != list) {
+      unlink_free(r, list, curr);
+      add_to_list(curr);
+    }
+  }
+}
+
+// deferred coalescing: merge every run of adjacent free blocks in one pass.
+// Only the first block of a run absorbs the rest, so a block that has grown
+// (and sits in a list that no longer fits its size until refiled) is never
+// itself absorbed. Blocks only grow, so a refiled block lands in a later bin
+// or the free list and is just visited again there.
+static void coalesce_all(Region *r) {
+  for (int k = 0; k <= (binning ? nclasses : 0); k += 1) {
+    Metadata **list = binning && k < nclasses ? &r->bins[k] : &r->head;
+    for (Metadata *curr = *list; curr; curr = PTR(curr->next_free)) {
+      if (curr->prev && !PTR(curr->prev)->used) {
+        continue;
+      }
+      while (curr->next && !PTR(curr->next)->used) {
+        merge_next(curr);
+      }
+      if (curr->slot != NO_SLOT) {
+        size_index[r - regions].size[curr->slot] = curr->size;
+      }
+    }
+    refile(r, list);
+  }
+  r->unmerged = 0;
+  if (r->last && !r->last->used) {
+    remove_from_list(r->last);
+    trim_tail(r, r->last);
+  }
+}
+
+// whether the bytes from lo to hi away from r's fixed end have not been handed out since allocator_reset
+static int untouched(Region *r, size_t lo, size_t hi) {
+  return lo >= r->peak && hi + r->pair->peak <= r->span;
+}
+
+// carve a new block from the unused space at the growing end of r
+static Metadata *bump(Region *r, size_t size) {
+  size_t total_size = sizeof(Metadata) + size;
+  if (r->used + r->pair->used + total_size > r->span) {
+    return NULL;  
+  }
+  Metadata *meta;
+  if (r->down) {
+    fresh = untouched(r, r->used, r->used + size);
+    meta = (Metadata *)(r->start - r->used - total_size);
+    meta->prev = LINK(NULL);
+    meta->next = LINK(r->last);
+    if (r->last) {
+      r->last->prev = LINK(meta);
+    }
+  } else {
+    fresh = untouched(r, r->used + sizeof(Metadata), r->used + total_size);
+    meta = (Metadata *)(r->start + r->used);
+    meta->prev = LINK(r->last);
+    meta->next = LINK(NULL);
+    if (r->last) {
+      r->last->next = LINK(meta);
+    }
+  }
+  meta->size = size;
+  meta->used = 1;
+  meta->region = r - regions;
+  r->last = meta;
+  r->used += total_size;
+  note_growth(r, total_size);
+  return meta;
+}
+
+// Re-derive the classes from the warmup histogram. Each observed size is served
+// by the smallest class at or above it, so the best table with k classes
+// splits the sorted sizes into k runs topped by a class; the dynamic program
+// picks the runs that waste the fewest bytes. Powers of two from 16 stay in the
+// table so sizes not seen during warmup still round up by less than 2x.
+#define BACKBONE_CLASSES 9
+static void learn_classes() {
+  static size_t size[CLASS_MAX / 8], count[CLASS_MAX / 8];
+  static size_t cost[MAX_CLASSES][CLASS_MAX / 8 + 1];
+  static short cut[MAX_CLASSES][CLASS_MAX / 8 + 1];
+  size_t total[CLASS_MAX / 8 + 1] = {0}, weighted[CLASS_MAX / 8 + 1] = {0};
+  size_t chosen[MAX_CLASSES];
+  int m = 0;
+  int k = MAX_CLASSES - 1 - BACKBONE_CLASSES;
+
+  for (int b = 1; b <= CLASS_MAX / 8; b += 1) {
+    if (size_hist[b]) {
+      size[m] = b * 8;
+      count[m] = size_hist[b];
+      total[m + 1] = total[m] + count[m];
+      weighted[m + 1] = weighted[m] + count[m] * size[m];
+      m += 1;
+    }
+  }
+  k = m < k ? m : k;
+  // cost[j][i]: least waste covering the first i sizes with j+1 classes
+  for (int i = 1; i <= m; i += 1) {
+    cost[0][i] = size[i - 1] * total[i] - weighted[i];
+  }
+  for (int j = 1; j < k; j += 1) {
+    for (int i = j + 1; i <= m; i += 1) {
+      cost[j][i] = (size_t)-1;
+      for (int from = j; from < i; from += 1) {
+        size_t run = size[i - 1] * (total[i] - total[from]) - (weighted[i] - weighted[from]);
+        if (cost[j - 1][from] + run < cost[j][i]) {
+          cost[j][i] = cost[j - 1][from] + run;
+          cut[j][i] = from;
+        }
+      }
+    }
+  }
+  int n = 0;
+  for (int j = k - 1, i = m; j >= 0 && i > 0; j -= 1) {
+    chosen[n++] = size[i - 1];
+    i = j ? cut[j][i] : 0;
+  }
+  for (size_t power = 16; power < CLASS_MAX; power *= 2) {
+    chosen[n++] = power;
+  }
+  set_classes(chosen, n);
+  for (int i = 0; i < NREGIONS; i += 1) {
+    for (int c = 0; c < MAX_CLASSES; c += 1) {
+      refile(&regions[i], &regions[i].bins[c]);
+    }
+    refile(&regions[i], &regions[i].head);
+  }
+  stats.classes_learned += 1;
+}
+
+// take a block from the bin for class c, or failing that the next larger non-empty one
+static Metadata *bin_fit(Region *r, int c) {
+  uint64_t candidates = r->full_bins & ~(((uint64_t)1 << c) - 1);
+  note_search(1);
+  return candidates ? r->bins[__builtin_ctzll(candidates)] : NULL;
+}
+
+// hand out size bytes of the free block curr in r, or of fresh space if curr is NULL
+static void *claim(Region *r, Metadata *curr, size_t size, int site) {
+  if (curr) {
+    fresh = 0;
+    remove_from_list(curr);
+    curr->used = 1;
+    if (worth_splitting(curr->size, size)) {
+      split(curr, size);
+    }
+  } else {
+    curr = bump(r, size);
+  }
+  if (!curr) {
+    return NULL;
+  }
+  curr->site = site;
+  curr->born = ticks++;
+  return (void *)(curr + 1);
+}
+
+// hand a free block that is on no list back to r: merge it with its free
+// neighbours (unless coalescing is deferred), then trim it off the tail or list it
+static void release(Region *r, Metadata *meta) {
+  if (policy.deferred) {
+    r->unmerged += 1;
+  } else {
+    merge_next(meta);
+    meta = merge_prev(meta);
+  }
+  if (at_tail(r, meta)) {
+    trim_tail(r, meta);
+  } else {
+    add_to_list(meta);
+  }
+}
+
+// give the first pad bytes of the used block back as a free block; returns the block holding the rest
+static Metadata *split_front(Metadata *block, size_t pad) {
+  Region *r = region_of(block);
+  Metadata *rest = (Metadata *)((char *)block + pad);
+  rest->size = block->size - pad;
+  rest->used = 1;
+  rest->region = block->region;
+  rest->site = block->site;
+  rest->born = block->born;
+  rest->prev = LINK(block);
+  rest->next = block->next;
+  if (rest->next) {
+    PTR(rest->next)->prev = LINK(rest);
+  } else if (!r->down) {
+    r->last = rest;
+  }
+  block->next = LINK(rest);
+  block->size = pad - sizeof(Metadata);
+  block->used = 0;
+  release(r, block);
+  return rest;
+}
+
+// claim a block of size bytes in r for call site slot site
+static void *alloc_in(Region *r, size_t size, int site) {
+  Metadata *curr = NULL;
+  int c = -1;
+  size_t pad = 0;
+
+  if (backlog()) {
+    drain_frees();
+  }
+  if (size > MAX_HEAP_SIZE) {
+    return NULL;
+  }
+  size = payload_size(size);
+  stats.mallocs += 1;
+  if (policy.color_threshold && size >= policy.color_threshold) {
+    pad = color++ % COLORS * CACHE_LINE;
+  }
+  if (binning && size <= CLASS_MAX && !pad) {
+    if (policy.learn_window && !classes_pinned && hist_seen < policy.learn_window) {
+      size_hist[(size + 7) / 8] += 1;
+      if (++hist_seen == policy.learn_window) {
+        learn_classes();
+      }
+    }
+    c = class_ceil[(size + 7) / 8];
+    stats.rounding_waste += class_size[c] - size;
+    size = class_size[c];
+    curr = bin_fit(r, c);
+  }
+  if (!curr) {
+    curr = search(r, size + pad);
+  }
+  if (!curr && r->unmerged) {
+    coalesce_all(r);
+    curr = c >= 0 ? bin_fit(r, c) : NULL;
+    curr = curr ? curr : search(r, size + pad);
+  }
+  if (curr && list_for(r, curr->size) == &r->head) {
+    r->rover = curr;
+  }
+  void *ptr = claim(r, curr, size + pad, site);
+  if (ptr && pad) {
+    ptr = split_front((Metadata *)ptr - 1, pad) + 1;
+  }
+  return ptr;
+}
+
+// slot in sites[] for pc, claiming a free one if pc is new
+static int site_index(const void *pc) {
+  size_t hash = (size_t)pc >> 2;
+  for (size_t probe = 0; probe < 8; probe += 1) {
+    size_t i = 1 + (hash + probe) % (SITES - 1);
+    if (sites[i].pc == pc) {
+      return i;
+    }
+    if (!sites[i].pc) {
+      sites[i].pc = pc;
+      return i;
+    }
+  }
+  return 0;
+}
+
+// after a warmup, a site is long-lived if most of its blocks are still live
+// or the ones freed so far lived at least long_lifetime ticks on average
+static int predicted_long(int i) {
+  if (i == 0 || sites[i].allocs < SITE_WARMUP) {
+    return 0;
+  }
+  if (sites[i].frees < sites[i].allocs / 2) {
+    return 1;
+  }
+  return sites[i].lifetime_sum / sites[i].frees >= policy.long_lifetime;
+}
+
+static void page_push(int *list, int p) {
+  slabs.page[p].prev = -1;
+  slabs.page[p].next = *list;
+  if (*list >= 0) {
+    slabs.page[*list].prev = p;
+  }
+  *list = p;
+}
+
+static void page_unlink(int *list, int p) {
+  SlabPage *page = &slabs.page[p];
+  if (page->prev >= 0) {
+    slabs.page[page->prev].next = page->next;
+  } else {
+    *list = page->next;
+  }
+  if (page->next >= 0) {
+    slabs.page[page->next].prev = page->prev;
+  }
+}
+
+// the slab page holding ptr, or -1 if ptr is a heap block
+static int slab_of(const void *ptr) {
+  if (!slabs.start || (char *)ptr < slabs.start || (char *)ptr >= slabs.start + (size_t)slabs.limit * PAGE_SIZE) {
+    return -1;
+  }
+  return ((char *)ptr - slabs.start) / PAGE_SIZE;
+}
+
+// take a page off the list of empty ones; -1 if there is none
+static int reuse_page() {
+  lock(pool_lock());
+  int p = slabs.empty;
+  if (p >= 0) {
+    page_unlink(&slabs.empty, p);
+  }
+  unlock(pool_lock());
+  return p;
+}
+
+// carve up to n fresh pages off the slab area's tail without a lock, setting
+// *got to how many; returns the first, or -1 once the area is used up
+static int carve_pages(int n, int *got) {
+  int first = atomic_load(&slabs.pages);
+  do {
+    if (first >= slabs.limit) {
+      return -1;
+    }
+    *got = first + n <= slabs.limit ? n : slabs.limit - first;
+  } while (!atomic_compare_exchange_weak(&slabs.pages, &first, first + *got));
+  note_footprint(*got * (PAGE_SIZE + sizeof(SlabPage)));
+  return first;
+}
+
+// a page of slots of the given size with one free, preferring want (or -1);
+// -1 if the slab area is used up. Under "binlock" want may be another
+// class's page, whose lock the caller does not hold, so it is not looked at.
+static int slab_page(size_t slot, int want) {
+  int *list = &slabs.cls[slot / ALIGNMENT].partial;
+  if (want >= 0 && policy.locking != LOCK_BINS && slabs.page[want].slot == slot && slabs.page[want].nfree) {
+    return want;
+  }
+  if (*list >= 0) {
+    return *list;
+  }
+  int p = reuse_page();
+  if (p < 0) {
+    int got;
+    p = carve_pages(1, &got);
+  }
+  if (p < 0) {
+    return -1;
+  }
+  SlabPage *page = &slabs.page[p];
+  size_t slots = PAGE_SIZE / slot;
+  page->slot = slot;
+  page->nfree = slots;
+  for (int w = 0; w < SLAB_WORDS; w += 1) {
+    size_t first = w * 64;
+    page->used[w] = first >= slots ? ~(uint64_t)0 : slots - first >= 64 ? 0 : ~(uint64_t)0 << (slots - first);
+  }
+  page_push(list, p);
+  return p;
+}
+
+// a fresh or empty page for this thread to bump slots of the given size
+// from, with all of them marked used; -1 if the slab area is full
+static int bump_page(BumpState *b, size_t slot) {
+  int p = b->stash < b->stash_end ? b->stash++ : reuse_page();
+  if (p < 0) {
+    int got;
+    p = carve_pages(BUMP_CHUNK, &got);
+    b->stash = p + 1;
+    b->stash_end = p < 0 ? 0 : p + got;
+  }
+  if (p < 0) {
+    return -1;
+  }
+  SlabPage *page = &slabs.page[p];
+  page->slot = slot;
+  page->nfree = 0;
+  memset(page->used, 0xff, sizeof(page->used));
+  return p;
+}
+
+// a slot of at least size bytes bumped from this thread's page for its
+// size; NULL if the slab area is full or too many threads have come
+static void *bump_alloc(size_t size) {
+  BumpState *b = &bumping;
+  if (b->resets != resets) {
+    b->resets = resets;
+    b->slot = thread_slot();
+    for (int k = 0; k <= SLAB_MAX / ALIGNMENT; k += 1) {
+      b->page[k] = -1;
+    }
+    b->stash = b->stash_end = 0;
+  }
+  size_t slot = payload_size(size);
+  int k = slot / ALIGNMENT;
+  if (b->slot < 0) {
+    return NULL;
+  }
+  if (b->page[k] < 0 || b->next[k] == PAGE_SIZE / slot) {
+    b->page[k] = bump_page(b, slot);
+    b->next[k] = 0;
+    if (b->page[k] < 0) {
+      return NULL;
+    }
+  }
+  bump_counts[b->slot].mallocs += 1;
+  bump_counts[b->slot].waste += slot - size;
+  fresh = 0;
+  return slabs.start + (size_t)b->page[k] * PAGE_SIZE + (size_t)b->next[k]++ * slot;
+}
+
+// a slot of at least size bytes, in the page of near if it has one free; NULL if the slab area is full
+static void *slab_alloc(size_t size, const void *near) {
+  // draining frees heap blocks and touches the queue, both the heap lock's
+  if (backlog()) {
+    heap_enter();
+    drain_frees();
+    heap_leave();
+  }
+  if (policy.bump && !near) {
+    void *ptr = bump_alloc(size);
+    if (ptr) {
+      return ptr;
+    }
+  }
+  size_t slot = payload_size(size);
+  SlabClass *cls = &slabs.cls[slot / ALIGNMENT];
+  lock(class_lock(cls));
+  int p = slab_page(slot, near ? slab_of(near) : -1);
+  if (p < 0) {
+    unlock(class_lock(cls));
+    return NULL;
+  }
+  SlabPage *page = &slabs.page[p];
+  int w = 0;
+  while (!~page->used[w]) {
+    w += 1;
+  }
+  int bit = __builtin_ctzll(~page->used[w]);
+  page->used[w] |= (uint64_t)1 << bit;
+  page->nfree -= 1;
+  if (!page->nfree) {
+    page_unlink(&cls->partial, p);
+  }
+  fresh = 0;
+  cls->mallocs += 1;
+  cls->waste += slot - size;
+  unlock(class_lock(cls));
+  return slabs.start + (size_t)p * PAGE_SIZE + (size_t)(w * 64 + bit) * slot;
+}
+
+// return ptr's slot to page p; a page left holding nothing can take any slot size
+static void slab_free(int p, void *ptr) {
+  SlabPage *page = &slabs.page[p];
+  // ptr's slot keeps the page at its size until it is cleared below
+  SlabClass *cls = &slabs.cls[page->slot / ALIGNMENT];
+  lock(class_lock(cls));
+  size_t i = ((char *)ptr - slabs.start - (size_t)p * PAGE_SIZE) / page->slot;
+  page->used[i / 64] &= ~((uint64_t)1 << i % 64);
+  if (!page->nfree++) {
+    page_push(&cls->partial, p);
+  }
+  if (page->nfree == PAGE_SIZE / page->slot) {
+    page_unlink(&cls->partial, p);
+    page->slot = 0;
+    lock(pool_lock());
+    page_push(&slabs.empty, p);
+    unlock(pool_lock());
+  }
+  unlock(class_lock(cls));
+}
+
+// A retired block's link to the next on its stack: a heap block's next_free,
+// unused while the block is, or a slab slot's word in its page's retired[],
+// holding the next block's 16-byte granule from base plus one (0 for NULL)
+static void *retire_link(void *ptr) {
+  int p = slab_of(ptr);
+  if (p < 0) {
+    return PTR(((Metadata *)ptr - 1)->next_free);
+  }
+  uint32_t link = slabs.page[p].retired[((char *)ptr - slabs.start) % PAGE_SIZE / ALIGNMENT];
+  return link ? (char *)base + (size_t)(link - 1) * ALIGNMENT : NULL;
+}
+
+static void set_retire_link(void *ptr, void *next) {
+  int p = slab_of(ptr);
+  if (p < 0) {
+    ((Metadata *)ptr - 1)->next_free = LINK((Metadata *)next);
+    return;
+  }
+  uint32_t link = next ? (uint32_t)(((char *)next - (char *)base) / ALIGNMENT + 1) : 0;
+  slabs.page[p].retired[((char *)ptr - slabs.start) % PAGE_SIZE / ALIGNMENT] = link;
+}
+
+static int slab_sized(size_t size) {
+  return slabs.start && size <= policy.oob_limit;
+}
+
+void *mymalloc(size_t size) {
+  return mymalloc_site(size, __builtin_return_address(0));
+}
+
+void *mymalloc_sized(size_t size, size_t *actual) {
+  void *ptr = mymalloc_site(size, __builtin_return_address(0));
+  if (ptr && actual) {
+    *actual = myusable_size(ptr);
+  }
+  return ptr;
+}
+
+size_t myusable_size(void *ptr) {
+  if (ptr && slab_of(ptr) >= 0) {
+    return slabs.page[slab_of(ptr)].slot;
+  }
+  return ptr ? ((Metadata *)ptr - 1)->size : 0;
+}
+
+void *mycalloc(size_t n, size_t size) {
+  if (size && n > SIZE_MAX / size) {
+    return NULL;
+  }
+  void *ptr = mymalloc_site(n * size, __builtin_return_address(0));
+  if (ptr && heap_zeroed && fresh) {
+    stats.zeroing_skipped += n * size;
+  } else if (ptr) {
+    memset(ptr, 0, n * size);
+  }
+  return ptr;
+}
+
+// the region a request of size bytes from site belongs in, setting *i to
+// the site's slot in sites[] (0 when not predicting)
+static Region *heap_region(size_t size, const void *site, int *i) {
+  Region *r = &regions[policy.high_threshold && size >= policy.high_threshold ? HIGH : LOW];
+  *i = 0;
+  if (policy.long_lifetime && regions[LONG_TERM].span) {
+    *i = site_index(site);
+    sites[*i].allocs += 1;
+    if (predicted_long(*i)) {
+      r = &regions[LONG_TERM];
+      stats.predicted_long += 1;
+    }
+  }
+  return r;
+}
+
+// mymalloc_site for the boundary-tag heap alone
+static void *heap_alloc(size_t size, const void *site) {
+  int i;
+  Region *r = heap_region(size, site, &i);
+  return alloc_in(r, size, i);
+}
+
+void *mymalloc_site(size_t size, const void *site) {
+  void *ptr = slab_sized(size) ? slab_alloc(size, NULL) : NULL;
+  if (!ptr) {
+    heap_enter();
+    ptr = heap_alloc(size, site);
+    heap_leave();
+  }
+  return ptr;
+}
+
+static void *mymalloc_hint_locked(size_t size, int hint) {
+  if (!policy.hints || !regions[LONG_TERM].span) {
+    return mymalloc(size);
+  }
+  switch (hint) {
+    case ALLOC_SHORT: return alloc_in(&regions[HIGH], size, 0);
+    case ALLOC_LONG: return alloc_in(&regions[LONG_TERM], size, 0);
+    case ALLOC_PERMANENT: return alloc_in(&regions[PERM], size, 0);
+    default: return mymalloc(size);
+  }
+}
+
+void *mymalloc_hint(size_t size, int hint) {
+  heap_enter();
+  void *ptr = mymalloc_hint_locked(size, hint);
+  heap_leave();
+  return ptr;
+}
+
+static int same_page(const void *a, const void *b) {
+  return (size_t)a / PAGE_SIZE == (size_t)b / PAGE_SIZE;
+}
+
+// the free block nearest to hint that can hold size bytes, walking the chain
+// both ways but staying within hint's page; NULL if there is none
+static Metadata *near_fit(Metadata *hint, size_t size) {
+  Metadata *after = hint->next && same_page(PTR(hint->next), hint) ? PTR(hint->next) : NULL;
+  Metadata *before = hint->prev && same_page(PTR(hint->prev), hint) ? PTR(hint->prev) : NULL;
+  Metadata *found = NULL;
+  size_t depth = 0;
+  while (!found && (before || after) && depth < NEAR_STEPS) {
+    if (after) {
+      depth += 1;
+      if (!after->used && after->size >= size) {
+        found = after;
+      }
+      after = after->next && same_page(PTR(after->next), hint) ? PTR(after->next) : NULL;
+    }
+    if (before && !found) {
+      depth += 1;
+      if (!before->used && before->size >= size) {
+        found = before;
+      }
+      before = before->prev && same_page(PTR(before->prev), hint) ? PTR(before->prev) : NULL;
+    }
+  }
+  note_search(depth);
+  return found;
+}
+
+// whether fresh space for size bytes at the growing end of r would share hint's page
+static int tail_near(Region *r, const void *hint, size_t size) {
+  size_t total_size = sizeof(Metadata) + size;
+  if (r->used + r->pair->used + total_size > r->span) {
+    return 0;
+  }
+  return same_page(r->down ? r->start - r->used - total_size : r->start + r->used, hint);
+}
+
+void *mymalloc_near(const void *hint, size_t size) {
+  if (hint == NULL) {
+    return mymalloc_site(size, __builtin_return_address(0));
+  }
+  if (slab_sized(size) || slab_of(hint) >= 0) {
+    void *ptr = slab_sized(size) ? slab_alloc(size, hint) : NULL;
+    if (!ptr) {
+      heap_enter();
+      ptr = heap_alloc(size, __builtin_return_address(0));
+      heap_leave();
+    }
+    return ptr;
+  }
+  Metadata *meta = (Metadata *)hint - 1;
+  Region *r = region_of(meta);
+  if (size > MAX_HEAP_SIZE) {
+    return NULL;
+  }
+  size_t rounded = payload_size(size);
+  rounded = binning && rounded <= CLASS_MAX ? class_size[class_ceil[rounded / 8]] : rounded;
+  heap_enter();
+  Metadata *curr = near_fit(meta, rounded);
+  void *ptr = NULL;
+  if (curr || tail_near(r, hint, rounded)) {
+    stats.mallocs += 1;
+    stats.near_placed += 1;
+    stats.rounding_waste += rounded - size;
+    ptr = claim(r, curr, rounded, 0);
+  }
+  heap_leave();
+  return ptr ? ptr : mymalloc_site(size, __builtin_return_address(0));
+}
+
+static void *myaligned_alloc_locked(size_t align, size_t size) {
+  if (align == 0 || (align & (align - 1))) {
+    return NULL;
+  }
+  if (align <= ALIGNMENT) {
+    return mymalloc_site(size, __builtin_return_address(0));
+  }
+  if (size > MAX_HEAP_SIZE) {
+    return NULL;
+  }
+  size = payload_size(size);
+  // enough for size bytes at the first boundary that leaves room for a free
+  // block in front, in the region size bytes alone would go to
+  int i;
+  Region *r = heap_region(size, __builtin_return_address(0), &i);
+  char *ptr = alloc_in(r, size + align + sizeof(Metadata), i);
+  if (!ptr) {
+    return NULL;
+  }
+  Metadata *meta = (Metadata *)ptr - 1;
+  size_t pad = round_up((size_t)ptr, align) - (size_t)ptr;
+  if (pad) {
+    while (pad < sizeof(Metadata) + ALIGNMENT) {
+      pad += align;
+    }
+    meta = split_front(meta, pad);
+  }
+  if (worth_splitting(meta->size, size)) {
+    split(meta, size);
+    remove_from_list(PTR(meta->next));
+    release(region_of(meta), PTR(meta->next));
+  }
+  return meta + 1;
+}
+
+void *myaligned_alloc(size_t align, size_t size) {
+  heap_enter();
+  void *ptr = myaligned_alloc_locked(align, size);
+  heap_leave();
+  return ptr;
+}
+
+int myposix_memalign(void **out, size_t align, size_t size) {
+  if (align == 0 || align % sizeof(void *) || (align & (align - 1))) {
+    return EINVAL;
+  }
+  void *ptr = myaligned_alloc(align, size);
+  if (!ptr) {
+    return ENOMEM;
+  }
+  *out = ptr;
+  return 0;
+}
+
+static void note_free(Metadata *meta) {
+  if (meta->site) {
+    sites[meta->site].frees += 1;
+    sites[meta->site].lifetime_sum += ticks - meta->born;
+  }
+}
+
+void myfree(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  if (policy.free_queue) {
+    heap_enter();
+    if (queued == policy.free_queue) {
+      drain_frees();
+    }
+    free_queue[queued++] = ptr;
+    heap_leave();
+    return;
+  }
+  if (slab_of(ptr) >= 0) {
+    slab_free(slab_of(ptr), ptr);
+    return;
+  }
+  Metadata *meta = (Metadata *)ptr - 1;
+  Region *r = region_of(meta);
+  heap_enter();
+  meta->used = 0;
+  note_free(meta);
+  release(r, meta);
+  heap_leave();
+}
+
+static int by_address(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)*(void *const *)a, y = (uintptr_t)*(void *const *)b;
+  return x < y ? -1 : x > y;
+}
+
+// free n blocks at once, reordering ptrs: in address order, each run of
+// neighbours in the batch becomes one free block before it is released, so
+// it meets the free lists once rather than once per block
+static void free_batch(void **ptrs, size_t n) {
+  if (n > 1) {
+    qsort(ptrs, n, sizeof(ptrs[0]), by_address);
+  }
+  for (size_t i = 0; i < n;) {
+    void *ptr = ptrs[i++];
+    if (slab_of(ptr) >= 0) {
+      slab_free(slab_of(ptr), ptr);
+      continue;
+    }
+    Metadata *meta = (Metadata *)ptr - 1;
+    meta->used = 0;
+    note_free(meta);
+    while (i < n && meta->next && (void *)(PTR(meta->next) + 1) == ptrs[i]) {
+      note_free(PTR(meta->next));
+      absorb_next(meta);
+      i += 1;
+    }
+    release(region_of(meta), meta);
+  }
+}
+
+// whether blocks are waiting for the next allocation to free them
+static int backlog() {
+  return atomic_load_explicit(&queued, memory_order_relaxed) || atomic_load_explicit(&ebr_ready, memory_order_relaxed);
+}
+
+// free every queued block and every retired block whose epoch has passed
+static void drain_frees() {
+  if (queued) {
+    free_batch(free_queue, queued);
+    stats.queue_drains += 1;
+    queued = 0;
+  }
+  void *list = atomic_exchange(&ebr_ready, NULL);
+  while (list) {
+    size_t n = 0;
+    size_t bytes = 0;
+    for (; list && n < FREE_QUEUE_MAX; list = retire_link(list)) {
+      bytes += myusable_size(list);
+      free_queue[n++] = list;
+    }
+    atomic_fetch_sub(&ebr_pending, bytes);
+    free_batch(free_queue, n);
+  }
+}
+
+int ebr_enter() {
+  if (thread_slot() < 0) {
+    return -1;
+  }
+  // publish the epoch, then check it did not move meanwhile, so that no advance can miss us
+  size_t e;
+  do {
+    e = atomic_load(&ebr_epoch);
+    atomic_store(&ebr_local[my_slot], e << 1 | 1);
+  } while (atomic_load(&ebr_epoch) != e);
+  return 0;
+}
+
+// move to the next epoch if every thread inside has seen this one; the
+// blocks retired two epochs ago are then out of every thread's reach
+static void ebr_advance() {
+  size_t e = atomic_load(&ebr_epoch);
+  size_t n = atomic_load(&thread_slots);
+  for (size_t i = 0; i < n && i < MAX_THREADS; i += 1) {
+    size_t local = atomic_load(&ebr_local[i]);
+    if ((local & 1) && local >> 1 != e) {
+      return;
+    }
+  }
+  if (!atomic_compare_exchange_strong(&ebr_epoch, &e, e + 1)) {
+    return;
+  }
+  atomic_fetch_add(&ebr_advances, 1);
+  void *list = atomic_exchange(&ebr_retired[(e + 2) % 3], NULL);
+  if (list) {
+    void *tail = list;
+    while (retire_link(tail)) {
+      tail = retire_link(tail);
+    }
+    void *ready = atomic_load(&ebr_ready);
+    do {
+      set_retire_link(tail, ready);
+    } while (!atomic_compare_exchange_weak(&ebr_ready, &ready, list));
+  }
+}
+
+void ebr_exit() {
+  // a thread ebr_enter turned away, or one that entered before allocator_reset, holds no slot
+  if (my_slot < 0 || my_slot_resets != resets) {
+    return;
+  }
+  atomic_store(&ebr_local[my_slot], atomic_load(&ebr_local[my_slot]) & ~(size_t)1);
+  // blocks retired in an older epoch wait only on an advance, so try one at
+  // once; ones retired in this epoch need two, so try every EBR_ADVANCE exits
+  size_t e = atomic_load(&ebr_epoch);
+  ebr_exits += 1;
+  if (ebr_retirements >= EBR_ADVANCE || atomic_load_explicit(&ebr_retired[(e + 2) % 3], memory_order_relaxed) ||
+      (ebr_exits >= EBR_ADVANCE && atomic_load_explicit(&ebr_retired[e % 3], memory_order_relaxed))) {
+    ebr_retirements = 0;
+    ebr_exits = 0;
+    ebr_advance();
+  }
+}
+
+void myfree_deferred(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  size_t bytes = myusable_size(ptr);
+  size_t pending = atomic_fetch_add(&ebr_pending, bytes) + bytes;
+  size_t peak = atomic_load(&ebr_pending_peak);
+  while (pending > peak && !atomic_compare_exchange_weak(&ebr_pending_peak, &peak, pending)) {
+  }
+  // the epoch after unlinking: a thread that enters later cannot have seen ptr
+  _Atomic(void *) *stack = &ebr_retired[atomic_load(&ebr_epoch) % 3];
+  void *head = atomic_load(stack);
+  do {
+    set_retire_link(ptr, head);
+  } while (!atomic_compare_exchange_weak(stack, &head, ptr));
+  ebr_retirements += 1;
+}
+
+// copy a block's contents to its new home for realloc, streaming large ones past the cache
+static void move_bytes(void *to, const void *from, size_t n) {
+  struct timespec t0, t1;
+  if (n >= LARGE_MOVE) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+  }
+  if (policy.stream_threshold && n >= policy.stream_threshold && stream_copy) {
+    stream_copy(to, from, n);
+  } else {
+    memcpy(to, from, n);
+  }
+  if (n >= LARGE_MOVE) {
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stats.large_moves += 1;
+    stats.large_move_bytes += n;
+    stats.large_move_nsec += (t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec;
+  }
+}
+
+// Resize the used block to between min and max bytes (multiples of ALIGNMENT)
+// without moving it: take the next block if it is free and, at the top of an
+// upward region, unused space beyond; give back anything past max. Returns 0,
+// changing nothing, if min cannot be reached.
+static int resize_in_place(Metadata *meta, size_t min, size_t max) {
+  Region *r = region_of(meta);
+  Metadata *next = PTR(meta->next);
+  size_t room = meta->size;
+  if (next && !next->used) {
+    room += sizeof(Metadata) + next->size;
+    next = PTR(next->next);
+  }
+  size_t spare = !r->down && !next ? r->span - r->used - r->pair->used : 0;
+  if (room + spare < min) {
+    return 0;
+  }
+  merge_next(meta);
+  if (meta->size < max && spare) {
+    size_t grow = max - meta->size < spare ? max - meta->size : spare;
+    meta->size += grow;
+    r->used += grow;
+    note_growth(r, grow);
+  }
+  if (worth_splitting(meta->size, max)) {
+    split(meta, max);
+    remove_from_list(PTR(meta->next));
+    release(r, PTR(meta->next));
+  }
+  return 1;
+}
+
+size_t mytry_expand(void *ptr, size_t min_size, size_t max_size) {
+  if (ptr == NULL || min_size > MAX_HEAP_SIZE) {
+    return 0;
+  }
+  size_t min = payload_size(min_size);
+  size_t max = max_size > MAX_HEAP_SIZE ? MAX_HEAP_SIZE : payload_size(max_size);
+  if (slab_of(ptr) >= 0) {
+    return min <= myusable_size(ptr) ? myusable_size(ptr) : 0;
+  }
+  Metadata *meta = (Metadata *)ptr - 1;
+  heap_enter();
+  size_t got = resize_in_place(meta, min, max > min ? max : min) ? meta->size : 0;
+  heap_leave();
+  return got;
+}
+
+static void *myrealloc_locked(void *ptr, size_t size) {
   if (!size) {
     myfree(ptr);
     return NULL;
@@ -168,41 +2153,154 @@ void *myrealloc(void *ptr, size_t size) {
   if (ptr == NULL) {
     return mymalloc(size);
   }
+  if (size > MAX_HEAP_SIZE) {
+    return NULL;
+  }
+  size = round_up(size, ALIGNMENT);
+  size_t old_size = myusable_size(ptr);
+  if (slab_of(ptr) >= 0 ? size <= old_size : resize_in_place((Metadata *)ptr - 1, size, size)) {
+    return ptr;
+  }
+  void *new_ptr = mymalloc(size);
+  if (new_ptr) {
+    move_bytes(new_ptr, ptr, old_size);
+    myfree(ptr);
+  }
+  return new_ptr;
+}
+
+void *myrealloc(void *ptr, size_t size) {
+  heap_enter();
+  void *new_ptr = myrealloc_locked(ptr, size);
+  heap_leave();
+  return new_ptr;
+}
+
+allocator_handle halloc(size_t size) {
+  heap_enter();
+  unsigned int h = free_handle ? free_handle : new_handles < HANDLES ? new_handles : 0;
+  void *ptr = h ? alloc_in(&regions[LOW], size, 0) : NULL;
+  if (!ptr) {
+    heap_leave();
+    return 0;
+  }
+  if (h == free_handle) {
+    free_handle = handles[h].next;
+  } else {
+    new_handles += 1;
+  }
   Metadata *meta = (Metadata *)ptr - 1;
-  size_t old_size = meta->size;
+  meta->used = MOVABLE;
+  meta->handle = h;
+  handles[h].block = meta;
+  handles[h].pins = 0;
+  heap_leave();
+  return h;
+}
 
-  if (size <= old_size) {
-    if (old_size - size >= sizeof(Metadata) + 8) {
-      split(meta, size);
+void *hpin(allocator_handle h) {
+  heap_enter();
+  handles[h].pins += 1;
+  void *ptr = handles[h].block + 1;
+  heap_leave();
+  return ptr;
+}
+
+void hunpin(allocator_handle h) {
+  heap_enter();
+  handles[h].pins -= 1;
+  heap_leave();
+}
+
+void hfree(allocator_handle h) {
+  heap_enter();
+  Metadata *meta = handles[h].block;
+  meta->used = 0;
+  release(region_of(meta), meta);
+  handles[h].block = NULL;
+  handles[h].next = free_handle;
+  free_handle = h;
+  heap_leave();
+}
+
+// Swap the free block gap (on no list) with the unpinned handle block after
+// it: the handle block slides down to gap's address and the free space ends up
+// after it. Returns the free block in its new place.
+static Metadata *slide_down(Metadata *gap) {
+  Region *r = region_of(gap);
+  Metadata *block = PTR(gap->next);
+  Metadata *prev = PTR(gap->prev);
+  Metadata *next = PTR(block->next);
+  size_t gap_size = gap->size;
+  size_t size = block->size;
+  unsigned int h = block->handle;
+  unsigned short site = block->site;
+
+  memmove(gap + 1, block + 1, size);
+  block = gap;
+  block->size = size;
+  block->used = MOVABLE;
+  block->site = site;
+  block->handle = h;
+  block->prev = LINK(prev);
+  handles[h].block = block;
+
+  gap = (Metadata *)((char *)(block + 1) + size);
+  gap->size = gap_size;
+  gap->used = 0;
+  gap->region = r - regions;
+  gap->prev = LINK(block);
+  gap->next = LINK(next);
+  block->next = LINK(gap);
+  if (next) {
+    next->prev = LINK(gap);
+  } else {
+    r->last = gap;
+  }
+  stats.bytes_compacted += size;
+  return gap;
+}
+
+size_t allocator_compact(size_t budget_ns) {
+  Region *r = &regions[LOW];
+  struct timespec t0, t;
+  size_t moved = 0;
+  heap_enter();
+  drain_frees();
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  Metadata *curr = r->used ? (Metadata *)r->start : NULL;
+  while (curr) {
+    if (curr->used) {
+      curr = PTR(curr->next);
+      continue;
     }
-    return ptr;
-} else {
-    Metadata *next_meta = meta->next;
-    if (next_meta && !next_meta->used &&
-      (meta->size + sizeof(Metadata) + next_meta->size) >= size) {
-      remove_from_list(next_meta);
-      meta->size += sizeof(Metadata) + next_meta->size;
-      meta->next = next_meta->next;
-      if (meta->next) {
-        meta->next->prev = meta;
-      } else {
-        last = meta;
+    remove_from_list(curr);
+    for (;;) {
+      while (curr->next && !PTR(curr->next)->used) {
+        merge_next(curr);
       }
-      if (meta->size >= size + sizeof(Metadata) + 8) {
-        split(meta, size);
+      Metadata *next = PTR(curr->next);
+      if (!next || next->used != MOVABLE || handles[next->handle].pins) {
+        break;
+      }
+      moved += next->size;
+      curr = slide_down(curr);
+      clock_gettime(CLOCK_MONOTONIC, &t);
+      if ((size_t)((t.tv_sec - t0.tv_sec) * 1000000000 + t.tv_nsec - t0.tv_nsec) >= budget_ns) {
+        break;
       }
-      return ptr;
     }
-    if (meta->next == NULL && used + (size - old_size) <= MAX_HEAP_SIZE) {
-      meta->size = size;
-      used += size - old_size;
-      return ptr;
+    Metadata *next = PTR(curr->next);
+    if (!next) {
+      trim_tail(r, curr);
+      break;
     }
-    void *new_ptr = mymalloc(size);
-    if (new_ptr) {
-      memcpy(new_ptr, ptr, old_size);
-      myfree(ptr);
+    add_to_list(curr);
+    if (moved && next->used == MOVABLE && !handles[next->handle].pins) {
+      break;  // out of time
     }
-    return new_ptr;
+    curr = next;
   }
+  heap_leave();
+  return moved;
 }
@@ -2,13 +2,224 @@
 
 /** Called once before any other function here; argument is the smallest usable address */
 void allocator_init(void *newbase);
+/**
+ * Sets how many bytes from the address given to allocator_init the heap
+ * spans: 128 MiB, the most it uses, unless told less. Takes effect at the
+ * next allocator_reset, so call it before allocator_init.
+ */
+void allocator_set_heap_size(size_t size);
 
 /** Called once before each test case; should free any used memory and reset for the next test */
 void allocator_reset();
 
-/** Like malloc but using the memory provided to allocator_init */
+/** Like malloc but using the memory provided to allocator_init; blocks are 16-byte aligned */
 void *mymalloc(size_t size);
 /** Like free but using the memory provided to allocator_init */
 void myfree(void *ptr);
 /** Like realloc but using the memory provided to allocator_init */
 void *myrealloc(void *ptr, size_t size);
+/**
+ * Like mymalloc, also storing in *actual (unless NULL) how many bytes the
+ * block can really hold, which may be more than size
+ */
+void *mymalloc_sized(size_t size, size_t *actual);
+/** How many bytes the live block ptr can hold; 0 for NULL */
+size_t myusable_size(void *ptr);
+/**
+ * Resizes the live block ptr without moving it, to at least min_size and at
+ * most max_size bytes, as far as a free block after it or unused heap space
+ * allows; a block already past max_size shrinks. Returns the new usable
+ * size, or 0 if min_size cannot be reached, in which case nothing changes.
+ */
+size_t mytry_expand(void *ptr, size_t min_size, size_t max_size);
+/**
+ * Like calloc: n zeroed elements of size bytes, or NULL, including when
+ * n * size overflows. Skips the zeroing for blocks carved from memory not
+ * handed out since allocator_reset when allocator_set_zeroed was called.
+ */
+void *mycalloc(size_t n, size_t size);
+/**
+ * Declares that the whole heap reads as zero right now, as fresh mmap
+ * memory does. Call it after allocator_reset, before allocating; it lasts
+ * until the next allocator_reset.
+ */
+void allocator_set_zeroed();
+/**
+ * Like aligned_alloc: a block of size bytes at a multiple of align, which
+ * must be a power of two, or NULL. The slack skipped to reach the boundary
+ * is returned to the free list. Free it with myfree.
+ */
+void *myaligned_alloc(size_t align, size_t size);
+/** Like posix_memalign, built on myaligned_alloc; returns 0, EINVAL or ENOMEM */
+int myposix_memalign(void **out, size_t align, size_t size);
+
+/** Names a movable block; 0 is no block */
+typedef unsigned int allocator_handle;
+/**
+ * Allocates a block of size bytes that allocator_compact may move while it
+ * is not pinned; returns its handle, or 0. Use it only through the calls
+ * below, never myfree or myrealloc.
+ */
+allocator_handle halloc(size_t size);
+/** Pins the block h, so it stays put, and returns where it is; pins nest */
+void *hpin(allocator_handle h);
+/** Undoes one hpin; pointers from it are stale once the block is unpinned */
+void hunpin(allocator_handle h);
+/** Frees the block h, pinned or not */
+void hfree(allocator_handle h);
+/**
+ * Slides unpinned handle blocks toward the base of the heap over the free
+ * space below them, lowering the heap's end once the free space reaches it.
+ * Works for about budget_ns nanoseconds (always at least one move) and picks
+ * up where the heap stands on the next call. Returns the bytes moved; 0
+ * means nothing below a movable block is free.
+ */
+size_t allocator_compact(size_t budget_ns);
+
+/**
+ * Epoch-based reclamation for lock-free structures. A thread reads shared
+ * blocks only between ebr_enter and ebr_exit; once it has unlinked a block,
+ * it retires it with myfree_deferred instead of myfree. The block keeps its
+ * contents until every thread then inside has left; it is then freed by
+ * whichever allocation comes next, in one address-ordered batch with the
+ * others ready by then. These three calls are lock-free and may run on any thread at once; the rest of
+ * this allocator still needs its callers to take turns.
+ * ebr_enter returns 0, or -1 while 256 other threads that have entered
+ * since allocator_reset are still running; an exiting thread's place is
+ * given to the next.
+ */
+int ebr_enter();
+/** Leaves the section begun by ebr_enter, now and then moving the epoch on */
+void ebr_exit();
+/** Frees ptr once no thread can still be reading it; call it inside ebr_enter */
+void myfree_deferred(void *ptr);
+
+/** Expected lifetime of an allocation, for mymalloc_hint */
+enum { ALLOC_SHORT = 1, ALLOC_LONG, ALLOC_PERMANENT };
+/**
+ * Like mymalloc, but places the block with others of the same expected
+ * lifetime (one of the ALLOC_ values) when the "hints" policy is active
+ */
+void *mymalloc_hint(size_t size, int hint);
+/**
+ * Like mymalloc, but attributes the block to the call site site for lifetime
+ * prediction; mymalloc passes its own return address. Wrappers around
+ * mymalloc should use this with their caller's address instead.
+ */
+void *mymalloc_site(size_t size, const void *site);
+/**
+ * Like mymalloc, but prefers free space in the same page as hint, nearest
+ * first, so that blocks traversed together (a node and its parent) share
+ * cache lines and pages. hint must be a live block from this allocator or
+ * NULL; without room near it, this is mymalloc.
+ */
+void *mymalloc_near(const void *hint, size_t size);
+
+/**
+ * Chooses the placement policy from a comma-separated spec of the tokens
+ * below; omitted parts take the default first,lifo,eager, and N, K, T and W
+ * take the defaults given when left out.
+ *
+ *   first, next, best  fit: first block that fits, first from where the last
+ *                      search stopped, or tightest
+ *   good:K             fit: tightest of the first K blocks that fit (K = 8)
+ *   lifo, addr         free-list order: last freed first, or by address
+ *   eager, deferred    coalesce on every free, or only once a search fails
+ *   bidir:N            requests of at least N bytes (256) grow down from the
+ *                      heap limit, smaller ones up from the base, each side
+ *                      with its own free list and tail
+ *   segregate:N        as bidir (N = 1024), but the large side is always
+ *                      searched best-fit whatever fit the spec names
+ *   hints              halves the heap: unhinted blocks grow up from the base
+ *                      and ALLOC_SHORT ones down from the middle; ALLOC_LONG
+ *                      ones up from the middle and ALLOC_PERMANENT ones down
+ *                      from the limit
+ *   predict:T          the same split, but sends blocks from call sites
+ *                      whose blocks mostly outlive T allocations (1024),
+ *                      learned from frees, to the ALLOC_LONG region
+ *   classes            rounds requests up to 4096 bytes to a size class and
+ *                      keeps free blocks in one bin per class; larger ones
+ *                      use the chosen fit
+ *   learn:W            classes, re-derived from the first W small requests
+ *                      (1024) to minimise rounding waste
+ *   color:N            starts each request of at least N bytes (4096) 0 to
+ *                      15 cache lines further on, rotating, so that arrays
+ *                      walked in lockstep do not share cache sets
+ *   stream:N           copies realloc moves of at least N bytes (1 MiB) with
+ *                      the widest non-temporal stores the CPU has
+ *   oob:N              serves requests of up to N bytes (256, at most 1024)
+ *                      from headerless 4 KiB slab pages in the top eighth of
+ *                      the heap, with each page's slot size and bitmap in a
+ *                      table beside it; hinted and over-aligned requests,
+ *                      and everything once the slabs run out, use the heap
+ *   thp                backs the heap with transparent huge pages and gives
+ *                      back whole ones beyond a region's retreating end
+ *   prefault           touches every page of the heap at allocator_reset, so
+ *                      no allocation faults; with thp nothing is given back
+ *   index              searches a packed array of free-list sizes, eight per
+ *                      AVX2 compare where the CPU has it; first and next fit
+ *                      take the first fit in array order
+ *   queue:N            myfree only queues blocks (256, at most 4096); the
+ *                      next allocation, or a myfree finding N queued, frees
+ *                      them as a batch
+ *   lock               any number of threads may call in at once, taking
+ *                      turns on one lock
+ *   binlock            as lock, but each oob slot size has a lock of its own,
+ *                      so small requests of different sizes run in parallel;
+ *                      the heap keeps one lock, as its frees merge any sizes,
+ *                      and mymalloc_near no longer prefers its hint's slab page
+ *   bump               with oob: each thread bumps slots from slab pages of
+ *                      its own with no lock or atomic, taking fresh pages
+ *                      eight at a time by one compare-and-swap, and keeps a
+ *                      partly used page per slot size and up to seven fresh
+ *                      ones to itself until allocator_reset
+ *
+ * allocator_init applies $ALLOCATOR_POLICY the same way; a new layout takes
+ * effect at the next allocator_reset.
+ * Returns 0, or -1 (leaving the policy unchanged) if spec is not understood.
+ */
+int allocator_set_policy(const char *spec);
+/** Whether the current policy lets several threads call in at once */
+int allocator_thread_safe();
+
+/** Counters describing allocator behaviour since the last allocator_reset */
+typedef struct allocator_stats {
+  size_t mallocs;           // calls to mymalloc
+  size_t searches;          // free-list searches performed
+  size_t search_steps;      // free blocks examined across all searches
+  size_t max_search_depth;  // most free blocks examined by one search
+  size_t fit_limit_hits;    // good-fit searches cut short by their candidate limit
+  size_t rounding_waste;    // bytes added by rounding requests up to a size class
+  size_t classes_learned;   // times the size classes were re-derived from observed requests
+  size_t predicted_long;    // allocations placed long-lived by call-site prediction
+  size_t near_placed;       // mymalloc_near calls served within their hint's page
+  size_t zeroing_skipped;   // bytes mycalloc returned without clearing because they were untouched
+  size_t large_moves;       // realloc moves of at least 64 KiB
+  size_t large_move_bytes;  // bytes copied by those moves
+  size_t large_move_nsec;   // time spent copying them
+  size_t bytes_released;    // heap bytes given back to the system as whole huge pages
+  size_t bytes_compacted;   // bytes of handle blocks moved by allocator_compact
+  size_t queue_drains;      // times blocks queued by myfree were freed as a batch
+  size_t retired_peak;      // most bytes passed to myfree_deferred and not yet freed at once
+  size_t epoch_advances;    // times the reclamation epoch moved on
+  size_t lock_waits;        // with "lock" or "binlock": times a thread had to wait for a lock
+  size_t peak_footprint;    // most heap bytes claimed at once, summed over all regions
+} allocator_stats;
+
+/** Copies the current counters into *out */
+void allocator_get_stats(allocator_stats *out);
+
+/**
+ * Copies up to max active size classes, ascending, into out; returns how
+ * many classes there are, or 0 when size classes are off. After learning,
+ * this is the table to pin for the next run.
+ */
+size_t allocator_get_size_classes(size_t *out, size_t max);
+/**
+ * Pins the size classes (each 1..4096 bytes, rounded up to a multiple of 16;
+ * 4096 is always added) and turns
+ * them on, without learning, from the next allocator_reset; n == 0 unpins.
+ * allocator_init reads a comma-separated table from $ALLOCATOR_CLASSES.
+ * Returns 0, or -1 if a size is out of range.
+ */
+int allocator_set_size_classes(const size_t *sizes, size_t n);
@@ -7,12 +7,17 @@
 #include <string.h>
 #include <time.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include "allocator.h"
 #include "testharness.h"
 
 static void *allmem;
 static int memBits;
 static size_t memUsed = 0;
+static int zero_heap = 0; // fill the heap with zeros instead of a pattern before each run
 
 
 // global error used to note problems with allocator
@@ -23,11 +28,14 @@ static const char *error = NULL;
 #define MAX_REGIONS 256
 static struct { void *p; size_t s; } regions[MAX_REGIONS];
 static int usedRegions = 0;
+// free_deferred may be called from several threads at once, so the tracker takes turns
+static pthread_mutex_t trackLock = PTHREAD_MUTEX_INITIALIZER;
 
-// track a new used region
-static void trackAdd(void *p, size_t s, int resize) {
+// track a new used region, holding trackLock
+static void trackAddLocked(void *p, size_t s, int resize) {
+  if (p == NULL) { error = "allocation failed"; return; } // out of memory, as the workloads report it
   if (p < allmem) { error = "Allocated illegal address"; return; }
-  if (p+s >= allmem+(1uL<<memBits)) { error = "Allocation overflowed"; return; }
+  if (p+s > allmem+(1uL<<memBits)) { error = "Allocation overflowed"; return; }
   
   // check all used regions to see if this overlaps any of them
   int dest = -1;
@@ -51,8 +59,15 @@ static void trackAdd(void *p, size_t s, int resize) {
   // track total memory usage
   if (newUse > memUsed) memUsed = newUse;
 }
+// track a new used region
+static void trackAdd(void *p, size_t s, int resize) {
+  pthread_mutex_lock(&trackLock);
+  trackAddLocked(p, s, resize);
+  pthread_mutex_unlock(&trackLock);
+}
 // stop tracking after free
 static void trackFree(void *p) {
+  pthread_mutex_lock(&trackLock);
   for(int i=0; i<usedRegions; i+=1) {
     if (regions[i].p == p) {
       regions[i].s = 0;
@@ -60,6 +75,7 @@ static void trackFree(void *p) {
       if (i == usedRegions-1) usedRegions -= 1;
     }
   }
+  pthread_mutex_unlock(&trackLock);
 }
 ////////////////////////////////////////////////////////////////////
 
@@ -67,16 +83,112 @@ static void trackFree(void *p) {
 // track malloc, both memory use and correctness
 void *wrapmalloc(size_t size) {
   if (error) return NULL;
-  void *ans = mymalloc(size);
+  void *ans = mymalloc_site(size, __builtin_return_address(0));
+  trackAdd(ans, size, 0);
+  if (error) return NULL;
+  return ans;
+}
+// track lifetime-hinted malloc, both memory use and correctness
+void *wrapmalloc_hint(size_t size, int hint) {
+  if (error) return NULL;
+  void *ans = mymalloc_hint(size, hint);
+  trackAdd(ans, size, 0);
+  if (error) return NULL;
+  return ans;
+}
+// track locality-hinted malloc, both memory use and correctness
+void *wrapmalloc_near(const void *hint, size_t size) {
+  if (error) return NULL;
+  void *ans = mymalloc_near(hint, size);
+  trackAdd(ans, size, 0);
+  if (error) return NULL;
+  return ans;
+}
+// track aligned malloc, both memory use and correctness
+void *wrapaligned_alloc(size_t align, size_t size) {
+  if (error) return NULL;
+  void *ans = myaligned_alloc(align, size);
   trackAdd(ans, size, 0);
   if (error) return NULL;
   return ans;
 }
+// track zeroed malloc, both memory use and correctness; NULL (on overflow) is not tracked
+void *wrapcalloc(size_t n, size_t size) {
+  if (error) return NULL;
+  void *ans = mycalloc(n, size);
+  if (ans) trackAdd(ans, n*size, 0);
+  if (error) return NULL;
+  return ans;
+}
+// track size-returning malloc, both memory use and correctness, over all the usable bytes
+void *wrapmalloc_sized(size_t size, size_t *actual) {
+  if (error) return NULL;
+  size_t usable = 0;
+  void *ans = mymalloc_sized(size, &usable);
+  if (ans && usable < size) { error = "Usable size smaller than requested"; return NULL; }
+  trackAdd(ans, usable, 0);
+  if (error) return NULL;
+  if (actual) *actual = usable;
+  return ans;
+}
+// track in-place resizing, both memory use and correctness
+size_t wraptry_expand(void *ptr, size_t min_size, size_t max_size) {
+  if (error) return 0;
+  size_t ans = mytry_expand(ptr, min_size, max_size);
+  if (ans && ans < min_size) { error = "Expanded block smaller than requested"; return 0; }
+  if (ans) trackAdd(ptr, ans, 1);
+  if (error) return 0;
+  return ans;
+}
+// sizes of live handle blocks, so the tracker can follow them when they move
+static size_t handleSizes[1 << 16];
+
+// where the block h is now, without leaving it pinned
+static void *handleAt(allocator_handle h) {
+  void *ans = hpin(h);
+  hunpin(h);
+  return ans;
+}
+// track movable malloc, both memory use and correctness
+allocator_handle wraphalloc(size_t size) {
+  if (error) return 0;
+  allocator_handle ans = halloc(size);
+  trackAdd(ans ? handleAt(ans) : NULL, size, 0);  // a 0 handle fails as a NULL block does
+  if (ans) handleSizes[ans] = size;
+  if (error) return 0;
+  return ans;
+}
+// track movable free
+void wraphfree(allocator_handle h) {
+  if (error) return;
+  trackFree(handleAt(h));
+  handleSizes[h] = 0;
+  hfree(h);
+}
+// track compaction: every live handle block is tracked again where it ended up
+size_t wrapcompact(size_t budget_ns) {
+  if (error) return 0;
+  for (size_t h = 1; h < sizeof(handleSizes) / sizeof(handleSizes[0]); h += 1) {
+    if (handleSizes[h]) trackFree(handleAt(h));
+  }
+  size_t ans = allocator_compact(budget_ns);
+  for (size_t h = 1; h < sizeof(handleSizes) / sizeof(handleSizes[0]); h += 1) {
+    if (handleSizes[h]) trackAdd(handleAt(h), handleSizes[h], 0);
+  }
+  if (error) return 0;
+  return ans;
+}
 // track free
 void wrapfree(void *ptr) {
   if (error) return;
+  trackFree(ptr); // first, since another thread may be handed the block as soon as it is freed
   myfree(ptr);
+}
+// track deferred free; the block stops being tracked before it can be reused
+void wrapfree_deferred(void *ptr) {
+  if (error) return;
   trackFree(ptr);
+  myfree_deferred(ptr);
 }
 // track remalloc, both memory use and correctness
 void *wraprealloc(void *ptr, size_t size) {
@@ -94,11 +206,62 @@ void *wraprealloc(void *ptr, size_t size) {
 
 // track malloc, just memory use (faster)
 void *wrapmalloc2(size_t size) {
-  void *ans = mymalloc(size);
+  void *ans = mymalloc_site(size, __builtin_return_address(0));
+  size_t newUse = ans+size-allmem;
+  if (newUse > memUsed) memUsed = newUse;
+  return ans;
+}
+// track lifetime-hinted malloc, just memory use (faster)
+void *wrapmalloc_hint2(size_t size, int hint) {
+  void *ans = mymalloc_hint(size, hint);
   size_t newUse = ans+size-allmem;
   if (newUse > memUsed) memUsed = newUse;
   return ans;
 }
+// track locality-hinted malloc, just memory use (faster)
+void *wrapmalloc_near2(const void *hint, size_t size) {
+  void *ans = mymalloc_near(hint, size);
+  size_t newUse = ans+size-allmem;
+  if (newUse > memUsed) memUsed = newUse;
+  return ans;
+}
+// track aligned malloc, just memory use (faster)
+void *wrapaligned_alloc2(size_t align, size_t size) {
+  void *ans = myaligned_alloc(align, size);
+  size_t newUse = ans+size-allmem;
+  if (newUse > memUsed) memUsed = newUse;
+  return ans;
+}
+// track zeroed malloc, just memory use (faster)
+void *wrapcalloc2(size_t n, size_t size) {
+  void *ans = mycalloc(n, size);
+  size_t newUse = ans+n*size-allmem;
+  if (ans && newUse > memUsed) memUsed = newUse;
+  return ans;
+}
+// track size-returning malloc, just memory use (faster)
+void *wrapmalloc_sized2(size_t size, size_t *actual) {
+  size_t usable = 0;
+  void *ans = mymalloc_sized(size, &usable);
+  size_t newUse = ans+usable-allmem;
+  if (newUse > memUsed) memUsed = newUse;
+  if (actual) *actual = usable;
+  return ans;
+}
+// track in-place resizing, just memory use (faster)
+size_t wraptry_expand2(void *ptr, size_t min_size, size_t max_size) {
+  size_t ans = mytry_expand(ptr, min_size, max_size);
+  size_t newUse = ptr+ans-allmem;
+  if (newUse > memUsed) memUsed = newUse;
+  return ans;
+}
+// track movable malloc, just memory use (faster)
+allocator_handle wraphalloc2(size_t size) {
+  allocator_handle ans = halloc(size);
+  size_t newUse = ans ? handleAt(ans)+size-allmem : 0;
+  if (newUse > memUsed) memUsed = newUse;
+  return ans;
+}
 // track remalloc, just memory (faster)
 void *wraprealloc2(void *ptr, size_t size) {
   if (error) return NULL;
@@ -112,18 +275,67 @@ void *wraprealloc2(void *ptr, size_t size) {
 static void resetTracing() {
   memUsed = 0;
   usedRegions = 0;
+  memset(handleSizes, 0, sizeof(handleSizes));
   error = NULL;
 
   static int blank = 0x00;
   blank += 97;
-  memset(allmem, blank, 1<<memBits);
+  memset(allmem, zero_heap ? 0 : blank, 1<<memBits);
+  if (zero_heap) allocator_set_zeroed();
 }
 
 
 static int unwrap_mode = 0;
+static int show_stats = 0;
+static int quiet = 0;
 
-static allocator safe_alloc = {wrapmalloc, wrapfree, wraprealloc};
-static allocator fast_alloc = {wrapmalloc2, myfree, wraprealloc2};
+// count L1 data-cache and data-TLB read misses for -s; -1 where perf events are unavailable
+static int missCounter = -1;
+static int tlbCounter = -1;
+static int openCacheCounter(int cache) {
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_HW_CACHE;
+  pe.size = sizeof(pe);
+  pe.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  pe.disabled = 1;
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+static void openMissCounter() {
+  missCounter = openCacheCounter(PERF_COUNT_HW_CACHE_L1D);
+  tlbCounter = openCacheCounter(PERF_COUNT_HW_CACHE_DTLB);
+  if (missCounter < 0) fprintf(stderr, "perf events unavailable; not counting cache misses\n");
+}
+static void startCounter(int fd) {
+  if (fd >= 0) { ioctl(fd, PERF_EVENT_IOC_RESET, 0); ioctl(fd, PERF_EVENT_IOC_ENABLE, 0); }
+}
+// stop fd and lower *fewest to its count
+static void stopCounter(int fd, unsigned long long *fewest) {
+  unsigned long long n;
+  if (fd < 0) return;
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(fd, &n, sizeof(n)) == sizeof(n) && n < *fewest) *fewest = n;
+}
+
+// resident bytes of this process, and how many of them are in transparent huge pages
+static void residentBytes(size_t *rss, size_t *huge) {
+  char line[256];
+  *rss = *huge = 0;
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  if (!f) return;
+  while (fgets(line, sizeof(line), f)) {
+    sscanf(line, "Rss: %zu kB", rss);
+    sscanf(line, "AnonHugePages: %zu kB", huge);
+  }
+  fclose(f);
+  *rss *= 1024;
+  *huge *= 1024;
+}
+
+static allocator safe_alloc = {wrapmalloc, wrapfree, wraprealloc, wrapmalloc_hint, wrapmalloc_near, wrapaligned_alloc, wrapcalloc, wrapmalloc_sized, myusable_size, wraptry_expand, wraphalloc, hpin, hunpin, wraphfree, wrapcompact, ebr_enter, ebr_exit, wrapfree_deferred, allocator_thread_safe};
+static allocator fast_alloc = {wrapmalloc2, myfree, wraprealloc2, wrapmalloc_hint2, wrapmalloc_near2, wrapaligned_alloc2, wrapcalloc2, wrapmalloc_sized2, myusable_size, wraptry_expand2, wraphalloc2, hpin, hunpin, hfree, allocator_compact, ebr_enter, ebr_exit, myfree_deferred, allocator_thread_safe};
 
 
 // prep to catch sigsegv (segfault)
@@ -133,12 +345,12 @@ static void ignore_signal(int sig, siginfo_t *unused1, void *unused2) {
 }
 
 
-struct testresult { int memuse; unsigned long long nsec; };
+struct testresult { int memuse; unsigned long long nsec; size_t footprint; };
 
 // run a test case. sofilename *must* include a '/' (example: "./mytest.so" not "mytest.so")
 static struct testresult runTest(const char *sofilename) {
   struct sigaction sa;
-  struct testresult ans = {-1, 0};
+  struct testresult ans = {-1, 0, 0};
 
   // catch sigsegv so that if this test crashes the program keeps running
   memset(&sa, 0, sizeof(struct sigaction));
@@ -154,11 +366,17 @@ static struct testresult runTest(const char *sofilename) {
     // run 5 times, keeping best timing result
     struct timespec t0, t1;
     unsigned long long bestnsec = 0xFFFFFFFFFFFFFFFFuL;
+    unsigned long long fewestmisses = 0xFFFFFFFFFFFFFFFFuL;
+    unsigned long long fewesttlbmisses = 0xFFFFFFFFFFFFFFFFuL;
     for(int i=0; i<5; i+=1) { // run 5 times, keep best timing result
       allocator_reset();
       resetTracing();
+      startCounter(missCounter);
+      startCounter(tlbCounter);
       clock_gettime(CLOCK_MONOTONIC, &t0);
       const char *ans = test(i ? &fast_alloc : &safe_alloc); // only use safe_alloc on first run
+      stopCounter(missCounter, &fewestmisses);
+      stopCounter(tlbCounter, &fewesttlbmisses);
       if (!error) error = ans;
       if (error) break;
       clock_gettime(CLOCK_MONOTONIC, &t1);
@@ -166,19 +384,49 @@ static struct testresult runTest(const char *sofilename) {
       if (nsec < bestnsec) bestnsec = nsec;
     }
     if (error) {
-      printf("❌ %-32s %s\n", sofilename, error);
+      if (!quiet) printf("❌ %-32s %s\n", sofilename, error);
       error = NULL;
     } else {
+      allocator_stats st;
+      allocator_get_stats(&st);
       ans.memuse = (int)memUsed;
       ans.nsec = bestnsec;
-      printf("✅ %-32s %12d B  %12llu ns\n", sofilename, ans.memuse, ans.nsec);
+      ans.footprint = st.peak_footprint;
+      if (!quiet) printf("✅ %-32s %12d B  %12llu ns\n", sofilename, ans.memuse, ans.nsec);
+      if (show_stats && !quiet) {
+        printf("   %-32s %12zu searches %10.2f avg depth %8zu max depth %8zu limit hits\n", "",
+          st.searches, st.searches ? (double)st.search_steps / st.searches : 0.0,
+          st.max_search_depth, st.fit_limit_hits);
+        printf("   %-32s %12zu B peak heap footprint\n", "", st.peak_footprint);
+        if (missCounter >= 0) printf("   %-32s %12llu L1d read misses (fewest in one run)\n", "", fewestmisses);
+        if (tlbCounter >= 0) printf("   %-32s %12llu dTLB read misses (fewest in one run)\n", "", fewesttlbmisses);
+        size_t rss, huge;
+        residentBytes(&rss, &huge);
+        printf("   %-32s %12zu B resident after the last run, %zu B in huge pages\n", "", rss, huge);
+        if (st.bytes_released) printf("   %-32s %12zu B given back as whole huge pages\n", "", st.bytes_released);
+        if (st.queue_drains) printf("   %-32s %12zu batches of queued frees\n", "", st.queue_drains);
+        if (st.epoch_advances) printf("   %-32s %12zu B most retired at once, %zu epochs\n", "", st.retired_peak, st.epoch_advances);
+        if (st.lock_waits) printf("   %-32s %12zu waits for a lock\n", "", st.lock_waits);
+        if (st.bytes_compacted) printf("   %-32s %12zu B moved by compaction\n", "", st.bytes_compacted);
+        if (st.large_moves) printf("   %-32s %12zu B in %zu large realloc moves, %.2f GB/s\n", "",
+          st.large_move_bytes, st.large_moves, st.large_move_nsec ? (double)st.large_move_bytes / st.large_move_nsec : 0.0);
+        if (st.zeroing_skipped) printf("   %-32s %12zu B not cleared by calloc, already zero\n", "", st.zeroing_skipped);
+        if (st.near_placed) printf("   %-32s %12zu placed near their hint\n", "", st.near_placed);
+        size_t classes[64];
+        size_t n = allocator_get_size_classes(classes, 64);
+        if (n) {
+          printf("   %-32s %12zu B rounding waste, %zu classes learned:\n", "", st.rounding_waste, st.classes_learned);
+          printf("   ALLOCATOR_CLASSES=");
+          for(size_t i=0; i<n; i+=1) printf("%zu%s", classes[i], i+1<n ? "," : "\n");
+        }
+      }
     }
     
     dlclose(dll); // clean up
 
   } else { // longjump call, only happens if sigsegv happens during normal call
     if (!error) error = "Segfault generated";
-    printf("❌ %-30s %s\n", sofilename, error);
+    if (!quiet) printf("❌ %-30s %s\n", sofilename, error);
   }
   
   // resume normal sigsegv handling
@@ -195,6 +443,73 @@ static int endsWith(const char *haystack, const char *needle) {
   return !strcmp(h2, needle);
 }
 
+static int compareNames(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// list workloads/*.so in name order; returns how many were found
+#define MAX_WORKLOADS 64
+static int listWorkloads(char names[MAX_WORKLOADS][512]) {
+  DIR *workloads = opendir("workloads");
+  struct dirent *so_entry;
+  char *sorted[MAX_WORKLOADS];
+  static char found[MAX_WORKLOADS][512];
+  int n = 0;
+  while(workloads && n < MAX_WORKLOADS && (so_entry = readdir(workloads)) != NULL) {
+    if (endsWith(so_entry->d_name, ".so")) {
+      strncpy(found[n], "workloads/", 512);
+      strncat(found[n], so_entry->d_name, 500);
+      sorted[n] = found[n];
+      n += 1;
+    }
+  }
+  if (workloads) closedir(workloads);
+  qsort(sorted, n, sizeof(char *), compareNames);
+  for(int i=0; i<n; i+=1) strcpy(names[i], sorted[i]);
+  return n;
+}
+
+// run every workload under each placement policy and print memory and time side by side;
+// memory is the highest address touched, footprint what the allocator claimed from both ends
+static const char *default_policies[] = {
+  "first", "next", "best", "good", "first,addr", "next,addr", "best,addr",
+  "first,deferred", "best,addr,deferred", "first,hints", "first,predict", "first,color", NULL
+};
+static void comparePolicies(const char **specs) {
+  static char names[MAX_WORKLOADS][512];
+  static struct testresult results[MAX_WORKLOADS][16];
+  int n = listWorkloads(names);
+  int p;
+
+  quiet = 1;
+  for(p=0; specs[p] && p<16; p+=1) {
+    if (allocator_set_policy(specs[p]) < 0) {
+      fprintf(stderr, "ERROR: unknown policy \"%s\"\n", specs[p]);
+      return;
+    }
+    for(int i=0; i<n; i+=1) results[i][p] = runTest(names[i]);
+  }
+  quiet = 0;
+  allocator_set_policy(NULL);
+
+  static const char *tables[] = { "memory (B)", "footprint (B)", "time (ns)" };
+  for(int table=0; table<3; table+=1) {
+    printf("\n%-32s", tables[table]);
+    for(int j=0; j<p; j+=1) printf(" %14s", specs[j]);
+    printf("\n");
+    for(int i=0; i<n; i+=1) {
+      printf("%-32s", names[i]);
+      for(int j=0; j<p; j+=1) {
+        if (results[i][j].memuse < 0) printf(" %14s", "failed");
+        else if (table == 2) printf(" %14llu", results[i][j].nsec);
+        else if (table == 1) printf(" %14zu", results[i][j].footprint);
+        else printf(" %14d", results[i][j].memuse);
+      }
+      printf("\n");
+    }
+  }
+}
+
 // specific cases mentioned in the MP description
 static struct { const char *so; int isTime; long long limit; int step; } key[] = {
   { "workloads/bst_simple.so", 2, 240000, 1}, // 2 means "must be *more* space than"
@@ -230,7 +545,20 @@ static const char *step_names[] = {
 // usage: ./tester ./mytest.so -- runs just that one test
 // usage: ./tester 29 -- runs full test suite with 2^29 bytes of memory (512 MiB)
 // usage: ./tester 23 ./mytest.so -- runs just one test with 2^23 bytes of memory (8 MiB)
+// usage: ./tester -s ... -- as above, also printing free-list search statistics and, where
+//        perf events are available, L1 data-cache misses
+// usage: ./tester -z ... -- as above, but zero-filling the heap before each run (as fresh mmap
+//        memory is) and telling the allocator so; -s comes first when both are given
+// usage: ./tester --policies -- runs all workloads under several placement policies
+// usage: ./tester --policies best,addr first,deferred -- ... under the listed policies
 int main(int argc, char *argv[]) {
+  const char **policies = NULL;
+  if (argc >= 2 && !strcmp(argv[1], "-s")) { show_stats = 1; argv += 1; argc -= 1; openMissCounter(); }
+  if (argc >= 2 && !strcmp(argv[1], "-z")) { zero_heap = 1; argv += 1; argc -= 1; }
+  if (argc >= 2 && !strcmp(argv[1], "--policies")) {
+    policies = argc > 2 ? (const char **)argv + 2 : default_policies;
+    argc = 1;
+  }
   memBits = 0;
   if (argc >= 2) memBits = atoi(argv[1]);
   if (memBits != 0) { argv += 1; argc -= 1; }
@@ -245,9 +573,12 @@ int main(int argc, char *argv[]) {
   }
   
 
+  allocator_set_heap_size(1uL<<memBits);
   allocator_init(allmem);
 
-  if (argc < 2) {
+  if (policies) {
+    comparePolicies(policies);
+  } else if (argc < 2) {
     runTest("./mytest.so");
     DIR *workloads = opendir("workloads");
     char soname[512];
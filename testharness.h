@@ -4,4 +4,20 @@ typedef struct {
   void *(*malloc)(size_t size);
   void (*free)(void *ptr);
   void *(*realloc)(void *ptr, size_t size);
+  void *(*malloc_hint)(size_t size, int hint); // hint is an ALLOC_ lifetime from allocator.h
+  void *(*malloc_near)(const void *hint, size_t size); // hint is a live block to place the new one near
+  void *(*aligned_alloc)(size_t align, size_t size); // align is a power of two
+  void *(*calloc)(size_t n, size_t size);
+  void *(*malloc_sized)(size_t size, size_t *actual); // *actual is set to the usable size
+  size_t (*usable_size)(void *ptr);
+  size_t (*try_expand)(void *ptr, size_t min_size, size_t max_size); // never moves; 0 on failure
+  unsigned int (*halloc)(size_t size); // a movable block; 0 on failure
+  void *(*hpin)(unsigned int h); // where h is; it stays there until the matching hunpin
+  void (*hunpin)(unsigned int h);
+  void (*hfree)(unsigned int h);
+  size_t (*compact)(size_t budget_ns); // bytes moved; 0 when there is nothing left to do
+  int (*ebr_enter)(void); // these three are safe to call from several threads at once
+  void (*ebr_exit)(void);
+  void (*free_deferred)(void *ptr); // frees ptr once every thread inside ebr_enter now has left
+  int (*thread_safe)(void); // whether threads may call the rest at once; otherwise they must take turns
 } allocator;
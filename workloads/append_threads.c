@@ -0,0 +1,46 @@
+// four threads each allocate 25,000 blocks of 16 to 256 bytes and never
+// free them, as a growth phase would; allocator_reset reclaims them. When
+// the allocator is not thread-safe the threads take turns on a lock of
+// their own.
+
+#include "testharness.h"
+#include <pthread.h>
+
+#define THREADS 4
+#define OPS 25000
+
+static allocator *alloc;
+static pthread_mutex_t turns = PTHREAD_MUTEX_INITIALIZER;
+static int take_turns;
+
+static void *worker(void *arg) {
+  unsigned r = (unsigned)(size_t)arg;
+  const char *bad = NULL;
+  for (int i = 0; i < OPS; i += 1) {
+    r = r * 1103515245 + 12345;
+    size_t size = 16 + (r >> 8) % 241;
+    if (take_turns) pthread_mutex_lock(&turns);
+    char *p = alloc->malloc(size);
+    if (take_turns) pthread_mutex_unlock(&turns);
+    if (p == NULL) {
+      bad = "allocation failed";
+      break;
+    }
+    p[0] = p[size - 1] = (char)i;
+  }
+  return (void *)bad;
+}
+
+const char *mytest(allocator *a) {
+  pthread_t threads[THREADS];
+  alloc = a;
+  take_turns = !a->thread_safe();
+  for (size_t i = 0; i < THREADS; i += 1) pthread_create(&threads[i], NULL, worker, (void *)(i + 1));
+  const char *bad = NULL;
+  for (int i = 0; i < THREADS; i += 1) {
+    void *ans;
+    pthread_join(threads[i], &ans);
+    if (ans) bad = ans;
+  }
+  return bad;
+}
@@ -0,0 +1,64 @@
+// builds an unbalanced BST of 40,000 values in a heap left full of scattered
+// holes, then validates it 50 times; bst_traverse_near.c builds the same tree
+// placing each node near its parent
+
+#include "testharness.h"
+
+#ifndef NEAR
+#define NEAR 0
+#endif
+
+#define FILLERS 60000
+
+typedef struct bst_node_t {
+  struct bst_node_t *left, *right;
+  int val;
+} bst_node;
+
+static int validate(bst_node *root, int lower_bound, int upper_bound) {
+  if (!root) return 1;
+  if (root->val < lower_bound || root->val > upper_bound) return 0;
+  return validate(root->left, lower_bound, root->val)
+      && validate(root->right, root->val, upper_bound);
+}
+
+const char *mytest(allocator *a) {
+  static void *fillers[FILLERS];
+  static int order[FILLERS / 2];
+  unsigned rng = 2024;
+
+  // fill the heap, then free every other block in random order so the free
+  // list hands out holes from all over it
+  for(int i=0; i<FILLERS; i+=1) {
+    rng = rng * 1103515245 + 12345;
+    fillers[i] = a->malloc(32 + 80 * ((rng >> 16) % 4)); // holes split evenly into 32-byte nodes and 48-byte headers
+    if (!fillers[i]) return "allocation failed";
+  }
+  for(int i=0; i<FILLERS/2; i+=1) order[i] = 2*i + 1;
+  for(int i=FILLERS/2-1; i>0; i-=1) {
+    rng = rng * 1103515245 + 12345;
+    int j = (rng >> 8) % (i + 1);
+    int t = order[i]; order[i] = order[j]; order[j] = t;
+  }
+  for(int i=0; i<FILLERS/2; i+=1) a->free(fillers[order[i]]);
+
+  bst_node *root = NULL;
+  for(int i=0; i<40000; i+=1) {
+    rng = rng * 1103515245 + 12345;
+    int val = rng >> 1;
+    bst_node *parent = NULL, **link = &root;
+    while (*link) {
+      parent = *link;
+      link = val <= parent->val ? &parent->left : &parent->right;
+    }
+    bst_node *n = NEAR ? a->malloc_near(parent, sizeof(bst_node)) : a->malloc(sizeof(bst_node));
+    if (!n) return "allocation failed";
+    n->val = val;
+    n->left = n->right = NULL;
+    *link = n;
+  }
+  for(int i=0; i<50; i+=1) {
+    if (!validate(root, 0x80000000, 0x7fffffff)) return "BST property violated";
+  }
+  return NULL;
+}
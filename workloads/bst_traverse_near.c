@@ -0,0 +1,4 @@
+// bst_traverse.c with each node allocated near its parent
+
+#define NEAR 1
+#include "bst_traverse.c"
@@ -0,0 +1,34 @@
+// sparse tables: zeroed arrays of 256 KiB to 1 MiB with a few hundred slots
+// set in each, 32 alive at a time; run with ./tester -z to let calloc skip
+// clearing memory that was never handed out
+
+#include "testharness.h"
+
+#define LIVE 32
+
+const char *mytest(allocator *a) {
+  unsigned long *tables[LIVE] = {0};
+  size_t lengths[LIVE] = {0};
+  unsigned rng = 99;
+
+  if (a->calloc((size_t)-1 / 2, 4)) return "overflowing calloc succeeded";
+  for(int round=0; round<64; round+=1) {
+    int slot = round % LIVE;
+    a->free(tables[slot]);
+    rng = rng * 1103515245 + 12345;
+    lengths[slot] = 32768 + (rng >> 8) % 98304;
+    tables[slot] = a->calloc(lengths[slot], sizeof(unsigned long));
+    if (!tables[slot]) return "allocation failed";
+    unsigned long *t = tables[slot];
+    for(size_t i=0; i<lengths[slot]; i+=509) {
+      if (t[i]) return "calloc memory not zeroed";
+    }
+    if (t[lengths[slot]-1]) return "calloc memory not zeroed";
+    for(int i=0; i<300; i+=1) {
+      rng = rng * 1103515245 + 12345;
+      t[(rng >> 4) % lengths[slot]] += 1;
+    }
+  }
+  for(int i=0; i<LIVE; i+=1) a->free(tables[i]);
+  return NULL;
+}
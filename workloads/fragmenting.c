@@ -0,0 +1,45 @@
+// fills the heap with small movable blocks, frees three in four of them and
+// then allocates larger blocks, none of which fit the holes left behind;
+// fragmenting_compact.c compacts the heap before the larger allocations
+
+#include "testharness.h"
+#include <string.h>
+
+#ifndef COMPACT
+#define COMPACT 0
+#endif
+
+#define SMALL 8000
+#define LARGE 2000
+
+const char *mytest(allocator *a) {
+  static unsigned int small[SMALL];
+  static void *large[LARGE];
+  for (int i = 0; i < SMALL; i += 1) {
+    small[i] = a->halloc(240);
+    if (!small[i]) return "allocation failed";
+    memset(a->hpin(small[i]), i, 240);
+    a->hunpin(small[i]);
+  }
+  for (int i = 0; i < SMALL; i += 1) {
+    if (i % 4) a->hfree(small[i]);
+  }
+  if (COMPACT) {
+    while (a->compact(100000)) {}
+  }
+  for (int i = 0; i < LARGE; i += 1) {
+    large[i] = a->malloc(1024);
+    if (!large[i]) return "allocation failed";
+    memset(large[i], i, 1024);
+  }
+  for (int i = 0; i < SMALL; i += 4) {
+    unsigned char *p = a->hpin(small[i]);
+    for (int j = 0; j < 240; j += 1) {
+      if (p[j] != (unsigned char)i) return "movable block changed";
+    }
+    a->hunpin(small[i]);
+    a->hfree(small[i]);
+  }
+  for (int i = 0; i < LARGE; i += 1) a->free(large[i]);
+  return 0;
+}
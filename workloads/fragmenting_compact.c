@@ -0,0 +1,4 @@
+// fragmenting.c with the heap compacted before the larger allocations
+
+#define COMPACT 1
+#include "fragmenting.c"
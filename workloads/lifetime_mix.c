@@ -0,0 +1,41 @@
+// a request loop: short-lived scratch buffers around a slowly churning cache,
+// with every allocation tagged by its expected lifetime
+
+#include "testharness.h"
+#include "allocator.h"
+
+#define CACHE_SLOTS 64
+
+const char *mytest(allocator *a) {
+  void *cache[CACHE_SLOTS] = {0};
+  unsigned rng = 12345;
+  char *config = a->malloc_hint(4096, ALLOC_PERMANENT);
+  if (!config) return "allocation failed";
+
+  for(int req=0; req<2000; req+=1) {
+    char *scratch[8];
+    int n = 1 + req % 8;
+    for(int i=0; i<n; i+=1) {
+      rng = rng * 1103515245 + 12345;
+      scratch[i] = a->malloc_hint(64 + (rng >> 16) % 2048, ALLOC_SHORT);
+      if (!scratch[i]) return "allocation failed";
+      scratch[i][0] = req;
+    }
+    if (req % 5 == 0) { // replace a cache entry
+      int slot = (rng >> 8) % CACHE_SLOTS;
+      a->free(cache[slot]);
+      cache[slot] = a->malloc_hint(32 + (rng >> 20) % 256, ALLOC_LONG);
+      if (!cache[slot]) return "allocation failed";
+    }
+    if (req % 100 == 0) { // registered once, never released
+      if (!a->malloc_hint(128, ALLOC_PERMANENT)) return "allocation failed";
+    }
+    for(int i=n-1; i>=0; i-=1) {
+      if (scratch[i][0] != (char)req) return "scratch buffer overwritten";
+      a->free(scratch[i]);
+    }
+  }
+  for(int i=0; i<CACHE_SLOTS; i+=1) a->free(cache[i]);
+  a->free(config);
+  return 0;
+}
@@ -0,0 +1,80 @@
+// four threads push and pop a shared lock-free (Treiber) stack 400,000
+// times between them; popped nodes are retired with free_deferred, so a
+// thread still reading a node it lost the race for never sees it reused.
+// The allocator itself is not thread-safe, so allocations take a lock.
+
+#include "testharness.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define THREADS 4
+#define OPS 100000
+
+typedef struct node { struct node *next; long val; } node;
+
+static allocator *alloc;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(node *) top;
+static _Atomic long pushed, popped;
+static _Atomic(const char *) failure;  // set by the first thread that cannot go on
+
+static void fail(const char *why) {
+  const char *none = NULL;
+  atomic_compare_exchange_strong(&failure, &none, why);
+}
+
+static void push(long val) {
+  pthread_mutex_lock(&alloc_lock);
+  node *n = alloc->malloc(sizeof(node));
+  pthread_mutex_unlock(&alloc_lock);
+  if (!n) {
+    fail("allocation failed");
+    return;
+  }
+  n->val = val;
+  n->next = atomic_load(&top);
+  while (!atomic_compare_exchange_weak(&top, &n->next, n)) {}
+  atomic_fetch_add(&pushed, val);
+}
+
+static void pop() {
+  if (alloc->ebr_enter() < 0) {
+    fail("too many threads for ebr_enter");
+    return;
+  }
+  node *n = atomic_load(&top);
+  while (n && !atomic_compare_exchange_weak(&top, &n, n->next)) {}
+  if (n) {
+    atomic_fetch_add(&popped, n->val);
+    alloc->free_deferred(n);
+  }
+  alloc->ebr_exit();
+}
+
+static void *worker(void *arg) {
+  unsigned r = (unsigned)(size_t)arg;
+  for (int i = 0; i < OPS && !failure; i += 1) {
+    r = r * 1103515245 + 12345;
+    if ((r >> 16) % 8 < 5) push(i + 1);
+    else pop();
+  }
+  return NULL;
+}
+
+const char *mytest(allocator *a) {
+  pthread_t threads[THREADS];
+  alloc = a;
+  top = NULL;
+  pushed = popped = 0;
+  failure = NULL;
+  for (size_t i = 0; i < THREADS; i += 1) pthread_create(&threads[i], NULL, worker, (void *)(i + 1));
+  for (int i = 0; i < THREADS; i += 1) pthread_join(threads[i], NULL);
+  // no other thread is left to read the nodes, so the rest are freed at once
+  for (node *n = top, *next; n; n = next) {
+    next = n->next;
+    popped += n->val;
+    a->free(n);
+  }
+  if (failure) return failure;
+  return pushed == popped ? 0 : "stack lost or duplicated a node";
+}
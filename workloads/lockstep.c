@@ -0,0 +1,42 @@
+// walks 16 equally sized arrays in lockstep, each element updated from the
+// same element of the previous array, the way realloc_works.c style code
+// walks parallel arrays. Each array is 64 KiB including its header, so
+// without cache coloring they all start at the same page offset.
+
+#include "testharness.h"
+
+#define ARRAYS 16
+#define ARRAY_SPAN (64 * 1024)
+
+// the bytes between one block's end and the next block: its header, 48
+// bytes by default and 32 built with -DCOMPACT_HEADERS
+static size_t header_size(allocator *a) {
+  char *p = a->malloc(2048), *q = a->malloc(2048);
+  size_t gap = !p || !q ? 0 : q > p ? q - p - a->usable_size(p) : p - q - a->usable_size(q);
+  a->free(q);
+  a->free(p);
+  return gap < ARRAY_SPAN / 2 ? gap : 0;
+}
+
+const char *mytest(allocator *a) {
+  unsigned long *arrays[ARRAYS];
+  size_t words = (ARRAY_SPAN - header_size(a)) / sizeof(unsigned long);
+  for(int k=0; k<ARRAYS; k+=1) {
+    arrays[k] = a->malloc(words * sizeof(unsigned long));
+    if (!arrays[k]) return "allocation failed";
+    for(size_t i=0; i<words; i+=1) arrays[k][i] = k == 0 ? i : 0;
+  }
+  for(int pass=0; pass<20; pass+=1) {
+    for(size_t i=0; i<words; i+=1) {
+      for(int k=1; k<ARRAYS; k+=1) arrays[k][i] += arrays[k-1][i];
+    }
+  }
+  // arrays[15][i] is i times C(20+14, 15), the number of paths the passes add up
+  unsigned long paths = 1;
+  for(int j=1; j<=15; j+=1) paths = paths * (19 + j) / j;
+  for(size_t i=0; i<words; i+=1) {
+    if (arrays[ARRAYS-1][i] != i * paths) return "arrays corrupted";
+  }
+  for(int k=0; k<ARRAYS; k+=1) a->free(arrays[k]);
+  return NULL;
+}
@@ -0,0 +1,33 @@
+// leaves 20,000 small free blocks scattered through 3 MiB in random list
+// order, then makes 200 requests that fit none of them, so every search
+// walks the whole free list; "index" scans packed sizes instead, and
+// "classes" skips straight to a bin that fits
+
+#include "testharness.h"
+
+#define BLOCKS 40000
+
+const char *mytest(allocator *a) {
+  static void *blocks[BLOCKS];
+  static int order[BLOCKS / 2];
+  unsigned rng = 5150;
+  for(int i=0; i<BLOCKS; i+=1) {
+    blocks[i] = a->malloc(32);
+    if (!blocks[i]) return "allocation failed";
+  }
+  for(int i=0; i<BLOCKS/2; i+=1) order[i] = 2*i;
+  for(int i=BLOCKS/2-1; i>0; i-=1) {
+    rng = rng * 1103515245 + 12345;
+    int j = (rng >> 8) % (i + 1);
+    int t = order[i]; order[i] = order[j]; order[j] = t;
+  }
+  for(int i=0; i<BLOCKS/2; i+=1) a->free(blocks[order[i]]);
+
+  void *big[200];
+  for(int i=0; i<200; i+=1) {
+    big[i] = a->malloc(64);
+    if (!big[i]) return "allocation failed";
+  }
+  for(int i=0; i<200; i+=1) a->free(big[i]);
+  return NULL;
+}
@@ -0,0 +1,66 @@
+// four threads each churn their own 256 blocks, 100,000 malloc/free pairs
+// apiece: mostly 16..256 bytes, one in eight up to 4 KiB. Blocks are filled
+// and checked, so threads handed overlapping memory are caught. When the
+// allocator is not thread-safe the threads take turns on a lock of their own.
+
+#include "testharness.h"
+#include <pthread.h>
+#include <string.h>
+
+#define THREADS 4
+#define OPS 100000
+#define SLOTS 256
+
+static allocator *alloc;
+static pthread_mutex_t turns = PTHREAD_MUTEX_INITIALIZER;
+static int take_turns;
+
+static void *worker(void *arg) {
+  unsigned char tag = (unsigned char)(size_t)arg;
+  unsigned r = tag;
+  void *slot[SLOTS] = {0};
+  size_t size[SLOTS];
+  const char *bad = NULL;
+  for (int i = 0; i < OPS && !bad; i += 1) {
+    r = r * 1103515245 + 12345;
+    int k = (r >> 8) % SLOTS;
+    if (slot[k]) {
+      if (((unsigned char *)slot[k])[0] != tag || ((unsigned char *)slot[k])[size[k] - 1] != tag) {
+        bad = "block changed under its owner";
+      }
+      if (take_turns) pthread_mutex_lock(&turns);
+      alloc->free(slot[k]);
+      if (take_turns) pthread_mutex_unlock(&turns);
+    }
+    r = r * 1103515245 + 12345;
+    size[k] = (r >> 8) % 8 ? 16 + (r >> 12) % 241 : 16 + (r >> 12) % 4081;
+    if (take_turns) pthread_mutex_lock(&turns);
+    slot[k] = alloc->malloc(size[k]);
+    if (take_turns) pthread_mutex_unlock(&turns);
+    if (slot[k] == NULL) {
+      bad = "allocation failed";
+      break;
+    }
+    memset(slot[k], tag, size[k]);
+  }
+  for (int k = 0; k < SLOTS; k += 1) {
+    if (take_turns) pthread_mutex_lock(&turns);
+    alloc->free(slot[k]);
+    if (take_turns) pthread_mutex_unlock(&turns);
+  }
+  return (void *)bad;
+}
+
+const char *mytest(allocator *a) {
+  pthread_t threads[THREADS];
+  alloc = a;
+  take_turns = !a->thread_safe();
+  for (size_t i = 0; i < THREADS; i += 1) pthread_create(&threads[i], NULL, worker, (void *)(i + 1));
+  const char *bad = NULL;
+  for (int i = 0; i < THREADS; i += 1) {
+    void *ans;
+    pthread_join(threads[i], &ans);
+    if (ans) bad = ans;
+  }
+  return bad;
+}
@@ -0,0 +1,46 @@
+// grows a buffer from 1 MiB to 32 MiB by doubling, with a small block
+// allocated after it each time so realloc has to move it (and the space it
+// leaves refilled); between moves it sums a 256 KiB table that should stay
+// in cache across the copies
+
+#include "testharness.h"
+#include <string.h>
+
+#define TABLE_WORDS (256 * 1024 / sizeof(long))
+
+const char *mytest(allocator *a) {
+  long *table = a->malloc(TABLE_WORDS * sizeof(long));
+  if (!table) return "allocation failed";
+  for(size_t i=0; i<TABLE_WORDS; i+=1) table[i] = i;
+
+  size_t size = 1 << 20;
+  char *buffer = a->malloc(size);
+  if (!buffer) return "allocation failed";
+  memset(buffer, 0x5a, size);
+  void *blockers[8], *fillers[8];
+  int moves = 0;
+  for(; size < (32 << 20); size *= 2, moves += 1) {
+    blockers[moves] = a->malloc(64);
+    if (!blockers[moves]) return "allocation failed";
+    char *grown = a->realloc(buffer, size * 2);
+    if (!grown) return "allocation failed";
+    if (grown[0] != 0x5a || grown[size-1] != 0x5a) return "realloc didn't copy data";
+    memset(grown + size, 0x5a, size);
+    buffer = grown;
+    fillers[moves] = a->malloc(size);
+    if (!fillers[moves]) return "allocation failed";
+
+    long sum = 0;
+    for(int pass=0; pass<20; pass+=1) {
+      for(size_t i=0; i<TABLE_WORDS; i+=8) sum += table[i];
+    }
+    if (sum != 20 * (long)(TABLE_WORDS / 8) * (long)(TABLE_WORDS - 8) / 2) return "table corrupted";
+  }
+  for(int i=0; i<moves; i+=1) {
+    a->free(blockers[i]);
+    a->free(fillers[i]);
+  }
+  a->free(buffer);
+  a->free(table);
+  return NULL;
+}
@@ -0,0 +1,76 @@
+// one thread replaces a shared node 100,000 times, retiring each old one
+// with free_deferred, while three others read the current node inside
+// ebr_enter, yield, and read its first word again: a retired node must keep
+// its contents until every reader that might hold it has left.
+// Only the writer allocates, so the allocator needs no lock.
+
+#include "testharness.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define READERS 3
+#define OPS 100000
+#define STAMP 0x5a5a5a5a5a5a5a5aL
+
+typedef struct node { long first; long id; } node;  // first is id ^ STAMP
+
+static allocator *alloc;
+static _Atomic(node *) current;
+static _Atomic int done;
+static _Atomic(const char *) failure;  // set by the first thread that cannot go on
+
+static void fail(const char *why) {
+  const char *none = NULL;
+  atomic_compare_exchange_strong(&failure, &none, why);
+}
+
+static void *reader(void *arg) {
+  (void)arg;
+  while (!done && !failure) {
+    if (alloc->ebr_enter() < 0) {
+      fail("too many threads for ebr_enter");
+      break;
+    }
+    node *n = atomic_load(&current);
+    for (int i = 0; i < 4 && n; i += 1) {
+      if (n->first != (n->id ^ STAMP)) {
+        fail("retired node changed while a reader held it");
+        break;
+      }
+      sched_yield();
+    }
+    alloc->ebr_exit();
+  }
+  return NULL;
+}
+
+const char *mytest(allocator *a) {
+  pthread_t threads[READERS];
+  alloc = a;
+  current = NULL;
+  done = 0;
+  failure = NULL;
+  for (size_t i = 0; i < READERS; i += 1) pthread_create(&threads[i], NULL, reader, NULL);
+  for (long i = 0; i < OPS && !failure; i += 1) {
+    node *n = a->malloc(sizeof(node));
+    if (!n) {
+      fail("allocation failed");
+      break;
+    }
+    n->id = i;
+    n->first = i ^ STAMP;
+    if (a->ebr_enter() < 0) {
+      a->free(n);
+      fail("too many threads for ebr_enter");
+      break;
+    }
+    a->free_deferred(atomic_exchange(&current, n));
+    a->ebr_exit();
+  }
+  done = 1;
+  for (int i = 0; i < READERS; i += 1) pthread_join(threads[i], NULL);
+  // no reader is left, so the last node is freed at once
+  a->free(atomic_exchange(&current, NULL));
+  return failure;
+}
@@ -0,0 +1,59 @@
+// a server loop: sessions open and close slowly while every request churns
+// through scratch buffers and a ring of recent log records, under rising load
+
+#include "testharness.h"
+
+#define SESSIONS 64
+#define LOG_RING 32
+
+struct session { int id; char state[180]; };
+
+static struct session *open_session(allocator *a, int id) {
+  struct session *s = a->malloc(sizeof(struct session));
+  if (s) s->id = id;
+  return s;
+}
+
+static char *request_buffer(allocator *a, size_t size) {
+  return a->malloc(size);
+}
+
+static char *log_record(allocator *a, size_t size) {
+  return a->malloc(size);
+}
+
+const char *mytest(allocator *a) {
+  struct session *sessions[SESSIONS];
+  char *ring[LOG_RING] = {0};
+  unsigned rng = 2024;
+
+  for(int i=0; i<SESSIONS; i+=1) {
+    sessions[i] = open_session(a, i);
+    if (!sessions[i]) return "allocation failed";
+  }
+  for(int req=0; req<4000; req+=1) {
+    char *buffers[6];
+    int n = 2 + req % 5;
+    for(int i=0; i<n; i+=1) {
+      rng = rng * 1103515245 + 12345;
+      buffers[i] = request_buffer(a, 64 + (rng >> 16) % (256 + req)); // payloads grow with load
+      if (!buffers[i]) return "allocation failed";
+    }
+    a->free(ring[req % LOG_RING]);
+    ring[req % LOG_RING] = log_record(a, 24 + req % 40);
+    if (!ring[req % LOG_RING]) return "allocation failed";
+    if (req % 10 == 0) { // a request closes one connection and accepts another
+      int slot = (rng >> 8) % SESSIONS;
+      a->free(sessions[slot]);
+      sessions[slot] = open_session(a, slot);
+      if (!sessions[slot]) return "allocation failed";
+    }
+    for(int i=0; i<n; i+=1) a->free(buffers[i]);
+    for(int i=0; i<SESSIONS; i+=8) {
+      if (sessions[i]->id != i) return "session overwritten";
+    }
+  }
+  for(int i=0; i<SESSIONS; i+=1) a->free(sessions[i]);
+  for(int i=0; i<LOG_RING; i+=1) a->free(ring[i]);
+  return 0;
+}
@@ -0,0 +1,4 @@
+// vector_relocate.c, growing each vector in place whenever the allocator can
+
+#define TRY_EXPAND 1
+#include "vector_relocate.c"
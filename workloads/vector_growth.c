@@ -0,0 +1,51 @@
+// grows 16 interleaved string builders by appends of 1 to 24 bytes, first
+// reallocating whenever the requested length runs out, then again using
+// the capacity the allocator reports; the second must not realloc more
+
+#include "testharness.h"
+#include <string.h>
+
+#define BUILDERS 16
+#define APPENDS 400
+
+typedef struct { char *data; size_t len, cap; } builder;
+
+static size_t build(allocator *a, int use_capacity, unsigned rng, const char **err) {
+  builder b[BUILDERS];
+  size_t reallocs = 0;
+  for(int i=0; i<BUILDERS; i+=1) {
+    b[i].len = 0;
+    b[i].data = use_capacity ? a->malloc_sized(8, &b[i].cap) : a->malloc(b[i].cap = 8);
+    if (!b[i].data) { *err = "allocation failed"; return 0; }
+  }
+  for(int n=0; n<APPENDS*BUILDERS; n+=1) {
+    rng = rng * 1103515245 + 12345;
+    builder *s = &b[(rng >> 8) % BUILDERS];
+    size_t piece = 1 + (rng >> 16) % 24;
+    if (s->len + piece > s->cap) {
+      char *grown = a->realloc(s->data, s->len + piece);
+      if (!grown) { *err = "allocation failed"; return 0; }
+      s->data = grown;
+      s->cap = use_capacity ? a->usable_size(grown) : s->len + piece;
+      reallocs += 1;
+    }
+    memset(s->data + s->len, 'a' + s->len % 26, piece);
+    s->len += piece;
+  }
+  for(int i=0; i<BUILDERS; i+=1) {
+    for(size_t j=0; j<b[i].len; j+=1) {
+      if (b[i].data[j] < 'a' || b[i].data[j] > 'z') { *err = "builder corrupted"; return 0; }
+    }
+    a->free(b[i].data);
+  }
+  return reallocs;
+}
+
+const char *mytest(allocator *a) {
+  const char *err = NULL;
+  size_t exact = build(a, 0, 77, &err);
+  size_t sized = build(a, 1, 77, &err);
+  if (err) return err;
+  if (sized > exact) return "usable capacity needed more reallocs";
+  return NULL;
+}
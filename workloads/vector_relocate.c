@@ -0,0 +1,64 @@
+// grows 8 interleaved vectors of self-referencing elements to 3000 each;
+// such elements cannot be memcpy'd, so every reallocation moves them one
+// by one and fixes them up. vector_expand.c first tries to grow in place.
+
+#include "testharness.h"
+
+#ifndef TRY_EXPAND
+#define TRY_EXPAND 0
+#endif
+
+#define VECTORS 8
+#define ELEMENTS 3000
+
+typedef struct element { struct element *self; long value; } element;
+typedef struct { element *data; size_t len, cap; } vector;
+
+// what a move constructor would do
+static void move_elements(element *to, element *from, size_t n) {
+  for(size_t i=0; i<n; i+=1) {
+    to[i].value = from[i].value;
+    to[i].self = &to[i];
+  }
+}
+
+static const char *grow(allocator *a, vector *v) {
+  size_t want = v->cap + v->cap / 2 + 4;
+  if (TRY_EXPAND && v->data) {
+    size_t got = a->try_expand(v->data, (v->cap + 1) * sizeof(element), want * sizeof(element));
+    if (got) {
+      v->cap = got / sizeof(element);
+      return NULL;
+    }
+  }
+  element *fresh = a->malloc(want * sizeof(element));
+  if (!fresh) return "allocation failed";
+  move_elements(fresh, v->data, v->len);
+  a->free(v->data);
+  v->data = fresh;
+  v->cap = want;
+  return NULL;
+}
+
+const char *mytest(allocator *a) {
+  vector v[VECTORS] = {0};
+  unsigned rng = 4242;
+  for(int n=0; n<VECTORS*ELEMENTS; n+=1) {
+    rng = rng * 1103515245 + 12345;
+    vector *pick = &v[(rng >> 8) % VECTORS];
+    if (pick->len == pick->cap) {
+      const char *err = grow(a, pick);
+      if (err) return err;
+    }
+    element *e = &pick->data[pick->len++];
+    e->self = e;
+    e->value = n;
+  }
+  for(int k=0; k<VECTORS; k+=1) {
+    for(size_t i=0; i<v[k].len; i+=1) {
+      if (v[k].data[i].self != &v[k].data[i]) return "element moved without fix-up";
+    }
+    a->free(v[k].data);
+  }
+  return NULL;
+}